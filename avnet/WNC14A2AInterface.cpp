@@ -23,7 +23,6 @@
  */
 
 #include <string.h>
-#include <fsl_rtc.h>
 #include "WNC14A2AInterface.h"
 #include "mbed-trace/mbed_trace.h"
 
@@ -32,19 +31,144 @@
 // Various timeouts for different operations
 #define WNC_CONNECT_TIMEOUT 15000
 #define WNC_SEND_TIMEOUT    15000
-#define WNC_RECV_TIMEOUT    40000
 #define WNC_MISC_TIMEOUT    40000
 
 // WNC14A2AInterface implementation
 WNC14A2AInterface::WNC14A2AInterface(PinName tx, PinName rx, PinName rstPin, PinName pwrPin, bool debug)
-    : _wnc(tx, rx, rstPin, pwrPin), _sockets(), _apn(), _userName(), _passPhrase(), _imei()
+    : _wnc(tx, rx, rstPin, pwrPin), _sockets(), _apn(), _userName(), _passPhrase(), _imei(),
+      _worker(osPriorityBelowNormal, sizeof(_worker_stack), (unsigned char *)_worker_stack),
+      _queue(sizeof(_queue_buffer), _queue_buffer),
+      _dns_thread(osPriorityBelowNormal, sizeof(_dns_stack), (unsigned char *)_dns_stack),
+      _dns_queue(sizeof(_dns_queue_buffer), _dns_queue_buffer), _worker_started(false), _process_pending(false),
+      _events_pending(0), _dispatch_pending(false), _tx_port(*this), _tx_sched(_tx_port)
 {
 
     tr_debug("init()\n");
     memset(_sockets, 0, sizeof(_sockets));
     memset(_cbs, 0, sizeof(_cbs));
+    memset(_handles, 0, sizeof(_handles));
+    memset(&_coalesce_stats, 0, sizeof(_coalesce_stats));
+
+    _route_clock = 0;
+    memset(_warm, 0, sizeof(_warm));
+    _link_up = false;
+    _refill_pending = false;
+    _sample_interval = MBED_CONF_APP_WNC_SAMPLE_INTERVAL;
+    _sample_event = 0;
+    _sample_deferred = false;
+
+    _connect_state = WNC_CONNECT_IDLE;
+    _recovery = WNC_RECOVER_RESET;
+    _link_generation = 0;
+    _connect_tries = 0;
+    _blocking = true;
+
+    memset(_dns, 0, sizeof(_dns));
+    memset(&_dns_stats, 0, sizeof(_dns_stats));
+    _dns_generation = _wnc.link_generation();
+    _dns_clock.start();
+    for (int i = 0; i < WNC_DNS_QUERIES; i++) {
+        _dns_queries[i].in_use = false;
+        _dns_queries[i].running = false;
+        _dns_queries[i].event = 0;
+        _dns_queries[i].generation = 0;
+    }
 
     _wnc.attach(this, &WNC14A2AInterface::event);
+    _wnc.attach_socket_event(callback(this, &WNC14A2AInterface::socket_event));
+    _wnc.attach_activity(callback(this, &WNC14A2AInterface::radio_activity));
+}
+
+void WNC14A2AInterface::start_worker() {
+    if (_worker_started) {
+        return;
+    }
+
+    if (_worker.start(callback(&_queue, &EventQueue::dispatch_forever)) != osOK) {
+        tr_error("worker thread failed to start\n");
+        return;
+    }
+    if (_dns_thread.start(callback(&_dns_queue, &EventQueue::dispatch_forever)) != osOK) {
+        tr_error("dns thread failed to start\n");
+    }
+    _queue.call_every(MBED_CONF_APP_WNC_POLL_INTERVAL, this, &WNC14A2AInterface::process);
+    if (_sample_interval) {
+        _sample_event = _queue.call_every(_sample_interval, this, &WNC14A2AInterface::sample);
+    }
+    _worker_started = true;
+}
+
+void WNC14A2AInterface::sample() {
+    // lowest priority work: skip the round if anyone is using the modem
+    if (!_wnc.trylock()) {
+        return;
+    }
+    // the modem is not woken for this, the round is done once it is up anyway
+    if (_tx_sched.asleep()) {
+        _sample_deferred = true;
+    } else if (_wnc.isInitialized()) {
+        _sample_deferred = false;
+        _wnc.sampleSignal();
+        _wnc.sampleBattery();
+    }
+    _wnc.unlock();
+}
+
+void WNC14A2AInterface::set_sample_interval(int interval_ms) {
+    _wnc.lock();
+    if (_sample_event) {
+        _queue.cancel(_sample_event);
+        _sample_event = 0;
+    }
+    _sample_interval = interval_ms > 0 ? interval_ms : 0;
+    if (_worker_started && _sample_interval) {
+        _sample_event = _queue.call_every(_sample_interval, this, &WNC14A2AInterface::sample);
+    }
+    _wnc.unlock();
+}
+
+void WNC14A2AInterface::process() {
+    _process_pending = false;
+    _wnc.process();
+    check_link();
+    sync_clock();
+    if (_sample_deferred) {
+        sample();
+    }
+}
+
+void WNC14A2AInterface::sync_clock() {
+    // network time needs registration, and never waits for the AT channel
+    if (!_wnc.isInitialized() || !_wnc.isRegistered()
+        || !_wnc.clockDue(MBED_CONF_APP_WNC_CLOCK_RESYNC)) {
+        return;
+    }
+    if (!_wnc.trylock()) {
+        return;
+    }
+    // stays due, and is picked up the next time the modem is awake
+    if (!_tx_sched.asleep()) {
+        _wnc.syncClock();
+    }
+    _wnc.unlock();
+}
+
+void WNC14A2AInterface::check_link() {
+    // a context drop or lost registration ends a link that was up
+    if (_connect_state != WNC_CONNECT_GLOBAL_UP
+        || (_wnc.link_generation() == _link_generation && _wnc.isRegistered())) {
+        return;
+    }
+    if (!_wnc.trylock()) {
+        return;
+    }
+
+    if (_connect_state == WNC_CONNECT_GLOBAL_UP) {
+        tr_error("link lost\n");
+        _link_up = false;
+        set_connect_state(WNC_CONNECT_IDLE);
+    }
+    _wnc.unlock();
 }
 
 bool WNC14A2AInterface::powerUpModem(){
@@ -83,6 +207,17 @@ const char *WNC14A2AInterface::get_imei(){
     return _imei;
 }
 
+void WNC14A2AInterface::get_identity(WncIdentity *identity){
+    // the ICCID is only read on demand, the SIM may not have been ready at boot
+    char iccid[sizeof(identity->iccid)];
+    _wnc.getICCID(iccid);
+    *identity = _wnc.identity();
+}
+
+bool WNC14A2AInterface::has_feature(uint32_t feature){
+    return _wnc.hasFeature(feature);
+}
+
 int WNC14A2AInterface::connect(const char *apn, const char *userName, const char *passPhrase)
 {
     tr_debug("connect(...)\n");
@@ -93,23 +228,214 @@ int WNC14A2AInterface::connect(const char *apn, const char *userName, const char
 int WNC14A2AInterface::connect()
 {
     tr_debug("connect()\n");
+    nsapi_error_t err = start_connect(WNC_RECOVER_RESET);
+    if (err) {
+        return err;
+    }
+
+    if (!_blocking) {
+        return post_connect();
+    }
+
+    while (!err && _connect_state != WNC_CONNECT_GLOBAL_UP) {
+        _wnc.lock();
+        err = connect_step();
+        _wnc.unlock();
+    }
+    return err;
+}
+
+nsapi_error_t WNC14A2AInterface::reconnect(wnc_recovery level)
+{
+    tr_debug("reconnect(%d)\n", (int)level);
+    nsapi_error_t err = start_connect(level);
+    if (err) {
+        return err;
+    }
+
+    return post_connect();
+}
+
+nsapi_error_t WNC14A2AInterface::post_connect()
+{
+    if (!_queue.call(this, &WNC14A2AInterface::connect_event)) {
+        // the queue is out of events, nothing would drive the attempt
+        _wnc.lock();
+        set_connect_state(WNC_CONNECT_IDLE);
+        _wnc.unlock();
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t WNC14A2AInterface::start_connect(wnc_recovery level)
+{
     _wnc.setTimeout(WNC_CONNECT_TIMEOUT);
+    start_worker();
 
-    if (!_wnc.startup()) {
-        return NSAPI_ERROR_DEVICE_ERROR;
+    _wnc.lock();
+    if (_connect_state != WNC_CONNECT_IDLE && _connect_state != WNC_CONNECT_GLOBAL_UP) {
+        _wnc.unlock();
+        return NSAPI_ERROR_IN_PROGRESS;
     }
+    _recovery = level;
+    _connect_tries = 0;
+    set_connect_state(WNC_CONNECT_STARTING);
+    _wnc.unlock();
 
-    if (!_wnc.connect(_apn, _userName, _passPhrase)) {
-        return NSAPI_ERROR_NO_CONNECTION;
+    return NSAPI_ERROR_OK;
+}
+
+void WNC14A2AInterface::connect_event()
+{
+    // one step per event, so the worker keeps serving other work in between
+    _wnc.lock();
+    if (_connect_state == WNC_CONNECT_IDLE || _connect_state == WNC_CONNECT_GLOBAL_UP) {
+        // disconnect() stopped it
+        _wnc.unlock();
+        return;
     }
+    nsapi_error_t err = connect_step();
+    bool done = err || _connect_state == WNC_CONNECT_GLOBAL_UP;
+    _wnc.unlock();
 
-    if (!_wnc.getIPAddress()) {
-        return NSAPI_ERROR_NO_ADDRESS;
+    if (!done) {
+        post_connect();
     }
+}
+
+nsapi_error_t WNC14A2AInterface::connect_step()
+{
+    nsapi_error_t err = NSAPI_ERROR_OK;
+
+    switch (_connect_state) {
+        case WNC_CONNECT_STARTING:
+            // a modem still attached with an address keeps its registration and context
+            if (_wnc.probeLink()) {
+                tr_debug("connect() reusing the PDN context\n");
+                set_connect_state(WNC_CONNECT_PDN_UP);
+                break;
+            }
+
+            _link_up = false;
+
+            // the cheaper recoveries keep the modem running, and its sockets
+            if (_recovery != WNC_RECOVER_RESET && _wnc.isInitialized()) {
+                bool alive = _recovery == WNC_RECOVER_CFUN ? _wnc.cycleRadio() : _wnc.isModemAlive();
+                if (alive) {
+                    drop_warm();
+                    set_connect_state(WNC_CONNECT_REGISTERING);
+                    break;
+                }
+            }
+
+            // startup resets the modem, sockets made in advance are gone
+            for (int i = 0; i < WNC_SOCKET_COUNT; i++) {
+                if (_warm[i]) {
+                    _warm[i] = 0;
+                    _sockets[i] = false;
+                }
+            }
+
+            if (!_wnc.startup()) {
+                err = NSAPI_ERROR_DEVICE_ERROR;
+                break;
+            }
+            set_connect_state(WNC_CONNECT_REGISTERING);
+            break;
+
+        case WNC_CONNECT_REGISTERING:
+            if (_wnc.registerNetwork(WNC_REG_TIMEOUT)) {
+                set_connect_state(WNC_CONNECT_ATTACHING);
+            } else if (++_connect_tries >= WNC_CONNECT_TRIES) {
+                err = NSAPI_ERROR_NO_CONNECTION;
+            }
+            break;
 
+        case WNC_CONNECT_ATTACHING:
+            _wnc.activatePDN(_apn, _userName, _passPhrase);
+
+            // the attach is judged by the result, not by the replies to each step
+            if (_wnc.probeLink()) {
+                set_connect_state(WNC_CONNECT_PDN_UP);
+            } else if (++_connect_tries >= WNC_CONNECT_TRIES) {
+                err = NSAPI_ERROR_NO_CONNECTION;
+            } else {
+                set_connect_state(WNC_CONNECT_REGISTERING);
+            }
+            break;
+
+        case WNC_CONNECT_PDN_UP:
+            err = link_ready();
+            if (!err) {
+                set_connect_state(WNC_CONNECT_GLOBAL_UP);
+            }
+            break;
+
+        case WNC_CONNECT_GLOBAL_UP:
+            break;
+
+        default:
+            // disconnect() or a lost link put it back to idle under us
+            err = NSAPI_ERROR_NO_CONNECTION;
+            break;
+    }
+
+    if (err && _connect_state != WNC_CONNECT_IDLE) {
+        tr_error("connect() failed in state %d: %d\n", (int)_connect_state, err);
+        set_connect_state(WNC_CONNECT_IDLE);
+    }
+    return err;
+}
+
+void WNC14A2AInterface::set_connect_state(wnc_connect_state state)
+{
+    _connect_state = state;
+    if (_status_cb) {
+        _status_cb(NSAPI_EVENT_CONNECTION_STATUS_CHANGE, get_connection_status());
+    }
+}
+
+nsapi_error_t WNC14A2AInterface::set_blocking(bool blocking)
+{
+    _blocking = blocking;
+    return NSAPI_ERROR_OK;
+}
+
+void WNC14A2AInterface::attach(Callback<void(nsapi_event_t, intptr_t)> status_cb)
+{
+    _status_cb = status_cb;
+}
+
+wnc_connect_state WNC14A2AInterface::get_connect_state() const
+{
+    return _connect_state;
+}
+
+nsapi_connection_status_t WNC14A2AInterface::get_connection_status() const
+{
+    switch (_connect_state) {
+        case WNC_CONNECT_IDLE:
+            return NSAPI_STATUS_DISCONNECTED;
+        case WNC_CONNECT_PDN_UP:
+            return NSAPI_STATUS_LOCAL_UP;
+        case WNC_CONNECT_GLOBAL_UP:
+            return NSAPI_STATUS_GLOBAL_UP;
+        default:
+            return NSAPI_STATUS_CONNECTING;
+    }
+}
+
+int WNC14A2AInterface::link_ready()
+{
     if(set_imei()){
         return NSAPI_ERROR_DEVICE_ERROR;
     }
+    _link_generation = _wnc.link_generation();
+
+    _link_up = true;
+    _refill_pending = true;
+    _queue.call(this, &WNC14A2AInterface::refill_warm);
     return NSAPI_ERROR_OK;
 }
 
@@ -129,6 +455,17 @@ int WNC14A2AInterface::set_credentials(const char *apn, const char *userName, co
 
 int WNC14A2AInterface::disconnect()
 {
+    _link_up = false;
+    drop_warm();
+
+    // waits for a connect step in progress, then stops the sequence
+    _wnc.lock();
+    dns_flush();
+    if (_connect_state != WNC_CONNECT_IDLE) {
+        set_connect_state(WNC_CONNECT_IDLE);
+    }
+    _wnc.unlock();
+
     _wnc.setTimeout(WNC_MISC_TIMEOUT);
 
     if (!_wnc.disconnect()) {
@@ -147,41 +484,341 @@ bool WNC14A2AInterface::get_location_date(char *lon, char *lat, tm *datetime, in
     return _wnc.getLocation(lon, lat, datetime, zone);
 }
 
+bool WNC14A2AInterface::get_date_time(tm *datetime, int *zone) {
+    return _wnc.getDateTime(datetime, zone);
+}
+
+void WNC14A2AInterface::get_clock_status(WncClockStatus *status) {
+    *status = _wnc.clock_status();
+}
+
 bool WNC14A2AInterface::queryIP(const char *url, const char *theIP){
     tr_debug("queryIP(url=%s)\n", url);
     return _wnc.queryIP(url, (char *)theIP);
 }
 
 bool WNC14A2AInterface::getModemBattery(uint8_t *status, int *level, int *voltage){
-    return _wnc.modem_battery(status, level, voltage);
+    WncSignalStatus signal = _wnc.signal_status();
+    if (!signal.battery_ms) {
+        return _wnc.modem_battery(status, level, voltage);
+    }
+
+    *status = signal.bat_status;
+    *level = signal.bat_level;
+    *voltage = signal.bat_voltage;
+    return true;
 }
 
-struct wnc_socket {
-    int id;
-    nsapi_protocol_t proto;
-    bool connected;
-    SocketAddress addr;
-};
+void WNC14A2AInterface::get_signal(WncSignalStatus *status){
+    *status = _wnc.signal_status();
+}
 
+void WNC14A2AInterface::get_coalesce_stats(WncCoalesceStats *stats) {
+    _wnc.lock();
+    *stats = _coalesce_stats;
+    _wnc.unlock();
+}
+
+void WNC14A2AInterface::get_registration(WncRegStatus *status) {
+    *status = _wnc.registration();
+}
+
+void WNC14A2AInterface::get_boot_stats(WncBootStats *stats) {
+    *stats = _wnc.boot_stats();
+}
+
+void WNC14A2AInterface::get_recv_stats(WncRecvStats *stats) {
+    *stats = _wnc.recv_stats();
+}
+
+nsapi_error_t WNC14A2AInterface::get_ip_stats(WncIpStats *stats) {
+    return _wnc.ip_stats(stats) ? NSAPI_ERROR_OK : NSAPI_ERROR_NO_CONNECTION;
+}
+
+void WNC14A2AInterface::get_pool_stats(WncPoolStats *sockets, WncPoolStats *packets) {
+    if (sockets) {
+        *sockets = _socket_pool.stats();
+    }
+    if (packets) {
+        *packets = _wnc.packet_pool_stats();
+    }
+}
+
+void WNC14A2AInterface::get_dns_stats(WncDnsStats *stats) {
+    _wnc.lock();
+    *stats = _dns_stats;
+    _wnc.unlock();
+}
+
+void WNC14A2AInterface::dns_flush()
+{
+    memset(_dns, 0, sizeof(_dns));
+    _dns_generation = _wnc.link_generation();
+    _dns_stats.flushes++;
+}
+
+struct wnc_dns_entry *WNC14A2AInterface::dns_lookup(const char *name)
+{
+    // addresses learned over a context that has since dropped may be stale
+    if (_dns_generation != _wnc.link_generation()) {
+        dns_flush();
+    }
+
+    uint32_t now = _dns_clock.read_ms();
+    for (int i = 0; i < MBED_CONF_APP_WNC_DNS_CACHE_SIZE; i++) {
+        struct wnc_dns_entry *entry = &_dns[i];
+        if (!entry->host[0] || strncmp(entry->host, name, sizeof(entry->host))) {
+            continue;
+        }
+        if ((int32_t)(entry->expires - now) <= 0) {
+            entry->host[0] = 0;
+            return NULL;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+void WNC14A2AInterface::dns_store(const char *name, const char *ip)
+{
+    uint32_t ttl = ip ? MBED_CONF_APP_WNC_DNS_TTL : MBED_CONF_APP_WNC_DNS_NEGATIVE_TTL;
+    if (!ttl || strlen(name) >= WNC_DNS_HOST_SIZE) {
+        return;
+    }
+
+    // an empty slot, or the entry closest to expiry
+    uint32_t now = _dns_clock.read_ms();
+    struct wnc_dns_entry *slot = &_dns[0];
+    for (int i = 0; i < MBED_CONF_APP_WNC_DNS_CACHE_SIZE; i++) {
+        if (!_dns[i].host[0]) {
+            slot = &_dns[i];
+            break;
+        }
+        if ((int32_t)(_dns[i].expires - slot->expires) < 0) {
+            slot = &_dns[i];
+        }
+    }
+
+    strcpy(slot->host, name);
+    strncpy(slot->ip, ip ? ip : "", sizeof(slot->ip) - 1);
+    slot->ip[sizeof(slot->ip) - 1] = 0;
+    slot->expires = now + ttl * 1000;
+}
 
 nsapi_error_t WNC14A2AInterface::gethostbyname(const char* name, SocketAddress *address, nsapi_version_t version)
    
 {
-   nsapi_error_t ret = NSAPI_ERROR_OK;
    if (version ==  NSAPI_IPv6) return NSAPI_ERROR_UNSUPPORTED;
+
+   // a literal address needs no lookup
+   if (address->set_ip_address(name)) {
+      return NSAPI_ERROR_OK;
+   }
+
    char ipAddr[16];
    memset(ipAddr,0,16);
-   this->queryIP(name, ipAddr);
+
+   _wnc.lock();
+   struct wnc_dns_entry *entry = dns_lookup(name);
+   if (entry) {
+      if (!entry->ip[0]) {
+         _dns_stats.negative_hits++;
+         _wnc.unlock();
+         return NSAPI_ERROR_DNS_FAILURE;
+      }
+      _dns_stats.hits++;
+      strcpy(ipAddr, entry->ip);
+      _wnc.unlock();
+   } else {
+      _dns_stats.misses++;
+      _wnc.unlock();
+
+      // queryIP() takes the AT channel per attempt, not for all its retries
+      bool found = this->queryIP(name, ipAddr);
+      _wnc.lock();
+      dns_store(name, found ? ipAddr : NULL);
+      _wnc.unlock();
+      if (!found) {
+         tr_debug("~gethostbyname(url=%s) failed\n", name);
+         return NSAPI_ERROR_DNS_FAILURE;
+      }
+   }
+
    address->set_ip_address(ipAddr);
    tr_debug("~gethostbyname(url=%s) = %s\n",name, ipAddr);
-   return ret;
+   return NSAPI_ERROR_OK;
 }
 
-int WNC14A2AInterface::socket_open(void **handle, nsapi_protocol_t proto)
+nsapi_error_t WNC14A2AInterface::gethostbyname_async(const char *name, wnc_hostbyname_cb_t callback,
+                                                     nsapi_version_t version)
 {
-    // Look for an unused socket
+    SocketAddress address;
+
+    if (version == NSAPI_IPv6) {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+    if (strlen(name) >= WNC_DNS_HOST_SIZE) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    // literal addresses and cached names never wait for the worker
+    if (address.set_ip_address(name)) {
+        if (callback) {
+            callback(NSAPI_ERROR_OK, &address);
+        }
+        return NSAPI_ERROR_OK;
+    }
+
+    _wnc.lock();
+    struct wnc_dns_entry *entry = dns_lookup(name);
+    if (entry) {
+        // an immediate failure is only returned, the callback is not called
+        if (!entry->ip[0]) {
+            _dns_stats.negative_hits++;
+            _wnc.unlock();
+            return NSAPI_ERROR_DNS_FAILURE;
+        }
+        _dns_stats.hits++;
+        address.set_ip_address(entry->ip);
+        _wnc.unlock();
+
+        if (callback) {
+            callback(NSAPI_ERROR_OK, &address);
+        }
+        return NSAPI_ERROR_OK;
+    }
+    _wnc.unlock();
+
+    if (!_link_up) {
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+
+    // the slot is filled in before it is marked in use, so cancel() and
+    // dns_resolve() never see a half written request
+    core_util_critical_section_enter();
+    int index = -1;
+    uint32_t generation = 0;
+    for (int i = 0; i < WNC_DNS_QUERIES; i++) {
+        struct wnc_dns_query *query = &_dns_queries[i];
+        if (!query->in_use) {
+            index = i;
+            strcpy(query->host, name);
+            query->version = version;
+            query->callback = callback;
+            query->running = false;
+            query->event = 0;
+            generation = ++query->generation;
+            query->in_use = true;
+            break;
+        }
+    }
+    core_util_critical_section_exit();
+    if (index < 0) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    struct wnc_dns_query *query = &_dns_queries[index];
+    int event = _dns_queue.call(this, &WNC14A2AInterface::dns_resolve, index, generation);
+    core_util_critical_section_enter();
+    if (query->generation == generation) {
+        query->event = event;
+        if (!event) {
+            query->in_use = false;
+        }
+    }
+    core_util_critical_section_exit();
+    if (!event) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    tr_debug("gethostbyname_async(url=%s) = %d\n", name, index + 1);
+    return index + 1;
+}
+
+nsapi_error_t WNC14A2AInterface::gethostbyname_async_cancel(int id)
+{
+    if (id < 1 || id > WNC_DNS_QUERIES) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    struct wnc_dns_query *query = &_dns_queries[id - 1];
+    core_util_critical_section_enter();
+    if (!query->in_use) {
+        core_util_critical_section_exit();
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    // a running lookup finishes, only its result is dropped
+    bool queued = !query->running;
+    int event = query->event;
+    query->callback = NULL;
+    if (queued) {
+        query->in_use = false;
+    }
+    core_util_critical_section_exit();
+
+    if (queued) {
+        // may be too late, dns_resolve() then sees the generation moved on
+        _dns_queue.cancel(event);
+    }
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t WNC14A2AInterface::prefetch_hostname(const char *name)
+{
+    nsapi_error_t err = gethostbyname_async(name, NULL);
+    return err > 0 ? NSAPI_ERROR_OK : err;
+}
+
+void WNC14A2AInterface::dns_resolve(int index, uint32_t generation)
+{
+    struct wnc_dns_query *query = &_dns_queries[index];
+
+    // a cancelled request, or its slot already taken again by a later one
+    core_util_critical_section_enter();
+    bool cancelled = !query->in_use || query->generation != generation;
+    query->running = !cancelled;
+    core_util_critical_section_exit();
+    if (cancelled) {
+        return;
+    }
+
+    SocketAddress address;
+    nsapi_error_t err = gethostbyname(query->host, &address, query->version);
+
+    core_util_critical_section_enter();
+    wnc_hostbyname_cb_t callback = query->callback;
+    query->running = false;
+    query->in_use = false;
+    core_util_critical_section_exit();
+
+    if (callback) {
+        callback(err, err ? NULL : &address);
+    }
+}
+
+int WNC14A2AInterface::open_id(nsapi_protocol_t proto)
+{
+    int type = proto == NSAPI_UDP ? WNC_UDP : WNC_TCP;
     int id = -1;
 
+    _wnc.lock();
+    // a socket created in advance only needs handing out
+    for (int i = 1; i < WNC_SOCKET_COUNT; i++) {
+        if (_warm[i] == type) {
+            tr_debug("open_id() = %d (warm)\n", i);
+            _warm[i] = 0;
+            _wnc.unlock();
+
+            if (_worker_started && !_refill_pending) {
+                _refill_pending = true;
+                _queue.call(this, &WNC14A2AInterface::refill_warm);
+            }
+            return i;
+        }
+    }
+
+    // Look for an unused socket
 //    for (int i = 0; i < WNC_SOCKET_COUNT; i++) {
     for (int i = 1; i < WNC_SOCKET_COUNT; i++) {
         if (!_sockets[i]) {
@@ -191,27 +828,127 @@ int WNC14A2AInterface::socket_open(void **handle, nsapi_protocol_t proto)
         }
     }
 
+    // take back a warm socket of the other protocol rather than fail
+    for (int i = 1; id == -1 && i < WNC_SOCKET_COUNT; i++) {
+        if (_warm[i]) {
+            _wnc.setTimeout(WNC_MISC_TIMEOUT);
+            _wnc.close(i);
+            _warm[i] = 0;
+            id = i;
+        }
+    }
+
     if (id == -1) {
+        _wnc.unlock();
         return NSAPI_ERROR_NO_SOCKET;
     }
 
-    struct wnc_socket *socket = new struct wnc_socket;
+    if (!_wnc.open(proto, id)) {
+        _sockets[id] = false;
+        _wnc.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    _wnc.unlock();
+
+    return id;
+}
+
+void WNC14A2AInterface::release_id(int id)
+{
+    _wnc.lock();
+    _wnc.setTimeout(WNC_MISC_TIMEOUT);
+    _wnc.close(id);
+    _handles[id] = NULL;
+    _sockets[id] = false;
+    _wnc.unlock();
+}
+
+void WNC14A2AInterface::refill_warm()
+{
+    _refill_pending = false;
+    if (!_link_up) {
+        return;
+    }
+
+    // only use the AT channel while nobody else needs it
+    if (!_wnc.trylock()) {
+        if (_worker_started) {
+            _refill_pending = true;
+            _queue.call_in(MBED_CONF_APP_WNC_POLL_INTERVAL, this, &WNC14A2AInterface::refill_warm);
+        }
+        return;
+    }
+
+    const int want[2] = { MBED_CONF_APP_WNC_WARM_TCP, MBED_CONF_APP_WNC_WARM_UDP };
+    const int type[2] = { WNC_TCP, WNC_UDP };
+    for (int p = 0; p < 2; p++) {
+        int have = 0;
+        for (int i = 1; i < WNC_SOCKET_COUNT; i++) {
+            if (_warm[i] == type[p]) {
+                have++;
+            }
+        }
+
+        for (int i = 1; have < want[p] && i < WNC_SOCKET_COUNT; i++) {
+            if (_sockets[i]) {
+                continue;
+            }
+
+            if (!_wnc.open(type[p] == WNC_UDP ? NSAPI_UDP : NSAPI_TCP, i)) {
+                break;
+            }
+            tr_debug("refill_warm() id=%d %s\n", i, type[p] == WNC_UDP ? "UDP" : "TCP");
+            _sockets[i] = true;
+            _warm[i] = type[p];
+            have++;
+        }
+    }
+    _wnc.unlock();
+}
+
+void WNC14A2AInterface::drop_warm()
+{
+    _wnc.lock();
+    for (int i = 0; i < WNC_SOCKET_COUNT; i++) {
+        if (_warm[i]) {
+            _wnc.setTimeout(WNC_MISC_TIMEOUT);
+            _wnc.close(i);
+            _warm[i] = 0;
+            _sockets[i] = false;
+        }
+    }
+    _wnc.unlock();
+}
+
+int WNC14A2AInterface::socket_open(void **handle, nsapi_protocol_t proto)
+{
+    int id = open_id(proto);
+    if (id < 0) {
+        return id;
+    }
+
+    struct wnc_socket *socket = _socket_pool.construct();
     if (!socket) {
+        release_id(id);
         return NSAPI_ERROR_NO_SOCKET;
     }
 
     socket->id = id;
     socket->proto = proto;
     socket->connected = false;
+    for (int i = 0; i < MBED_CONF_APP_WNC_UDP_ROUTES; i++) {
+        socket->routes[i].id = -1;
+        socket->routes[i].connected = false;
+    }
+    socket->routes[0].id = id;
+    socket->coalesce_delay = 0;
+    socket->flush_event = 0;
+    socket->tx_error = NSAPI_ERROR_OK;
+    socket->txlen = 0;
     *handle = socket;
     tr_debug("socket_open() = %d\n",id);
 
-#if 1
-    if (!_wnc.open(proto, socket->id)) {
-        return NSAPI_ERROR_DEVICE_ERROR;
-    }
-#endif
-
+    _handles[id] = socket;
     return 0;
 }
 
@@ -219,18 +956,43 @@ int WNC14A2AInterface::socket_close(void *handle)
 {
     struct wnc_socket *socket = (struct wnc_socket *)handle;
     int err = 0;
-    _wnc.setTimeout(WNC_MISC_TIMEOUT);
 
+    _wnc.lock();
+    // coalesced data is still owed to the peer
+    flush(socket);
+    _handles[socket->id] = NULL;
+
+    // nothing may be delivered to a socket that is gone
+    core_util_critical_section_enter();
+    _events_pending &= ~(1u << socket->id);
+    _cbs[socket->id].callback = NULL;
+    core_util_critical_section_exit();
+
+    // extra modem sockets of a UDP socket
+    for (int i = 1; i < MBED_CONF_APP_WNC_UDP_ROUTES; i++) {
+        if (socket->routes[i].id >= 0) {
+            release_id(socket->routes[i].id);
+        }
+    }
+
+    _wnc.setTimeout(WNC_MISC_TIMEOUT);
     if (!_wnc.close(socket->id)) {
         err = NSAPI_ERROR_DEVICE_ERROR;
     }
+    _sockets[socket->id] = false;
+    _wnc.unlock();
 
     tr_debug("socket_close(%d)\n",socket->id);
-    _sockets[socket->id] = false;
-    delete socket;
+    _socket_pool.destroy(socket);
     return err;
 }
 
+bool WNC14A2AInterface::socket_closed(void *handle)
+{
+    struct wnc_socket *socket = (struct wnc_socket *)handle;
+    return _wnc.is_closed(socket->id);
+}
+
 int WNC14A2AInterface::socket_bind(void *handle, const SocketAddress &address)
 {
     return NSAPI_ERROR_UNSUPPORTED;
@@ -260,6 +1022,12 @@ int WNC14A2AInterface::socket_connect(void *handle, const SocketAddress &addr)
 #endif
 
     socket->connected = true;
+    socket->addr = addr;
+    if (socket->proto == NSAPI_UDP) {
+        socket->routes[0].connected = true;
+        socket->routes[0].addr = addr;
+        socket->routes[0].last_used = ++_route_clock;
+    }
     return 0;
 }
 
@@ -271,73 +1039,534 @@ int WNC14A2AInterface::socket_accept(void *server, void **socket, SocketAddress
 int WNC14A2AInterface::socket_send(void *handle, const void *data, unsigned size)
 {
     struct wnc_socket *socket = (struct wnc_socket *)handle;
+
+    if (socket->coalesce_delay) {
+        _wnc.lock();
+        nsapi_error_t err = socket->tx_error;
+        socket->tx_error = NSAPI_ERROR_OK;
+
+        // make room, or write out everything if this one is large by itself
+        if (!err && socket->txlen + size > sizeof(socket->txbuf)) {
+            err = flush(socket);
+        }
+
+        if (!err && size < sizeof(socket->txbuf)) {
+            memcpy(socket->txbuf + socket->txlen, data, size);
+            socket->txlen += size;
+            _coalesce_stats.writes_coalesced++;
+
+            if (socket->txlen == sizeof(socket->txbuf)) {
+                err = flush(socket);
+            } else if (_tx_sched.active()) {
+                // goes out with the next transmit window
+                _tx_sched.queued();
+            } else if (!socket->flush_event) {
+                socket->flush_event = _queue.call_in(socket->coalesce_delay,
+                                                     this, &WNC14A2AInterface::flush_event, socket->id);
+            }
+            _wnc.unlock();
+            return err ? err : (int)size;
+        }
+        _wnc.unlock();
+
+        if (err) {
+            return err;
+        }
+    }
+
     _wnc.setTimeout(WNC_SEND_TIMEOUT);
 
-    if (!_wnc.send(socket->id, data, size)) {
+    // only what the modem acknowledged counts as sent
+    int32_t sent = _wnc.send(socket->id, data, size);
+    if (sent < 0) {
+        // a refused write does not go away by retrying it, fail the send
+        return _wnc.is_closed(socket->id) ? NSAPI_ERROR_CONNECTION_LOST : NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    // write completion, wakes a sender that saw WOULD_BLOCK
+    socket_event(socket->id);
+    return sent;
+}
+
+nsapi_error_t WNC14A2AInterface::flush(struct wnc_socket *socket)
+{
+    if (socket->flush_event) {
+        _queue.cancel(socket->flush_event);
+        socket->flush_event = 0;
+    }
+
+    if (!socket->txlen) {
+        return NSAPI_ERROR_OK;
+    }
+
+    unsigned len = socket->txlen;
+
+    _wnc.setTimeout(WNC_SEND_TIMEOUT);
+    int32_t sent = _wnc.send(socket->id, socket->txbuf, len);
+    if (sent != (int32_t)len) {
+        // keep what the modem did not take, the next flush starts with it
+        if (sent > 0) {
+            memmove(socket->txbuf, socket->txbuf + sent, len - sent);
+            socket->txlen = len - sent;
+        }
+        tr_error("flush(%d) failed, %d of %u bytes sent\n", socket->id, (int)sent, len);
         return NSAPI_ERROR_DEVICE_ERROR;
     }
+    socket->txlen = 0;
+
+    _coalesce_stats.flushes++;
+    _coalesce_stats.bytes_flushed += len;
+    return NSAPI_ERROR_OK;
+}
+
+void WNC14A2AInterface::flush_event(int id)
+{
+    _wnc.lock();
+    // the socket may have been closed while the event was queued
+    struct wnc_socket *socket = _handles[id];
+    if (socket && socket->flush_event) {
+        socket->flush_event = 0;
+        nsapi_error_t err = flush(socket);
+        if (err) {
+            socket->tx_error = err;
+        }
+        socket_event(id);
+    }
+    _wnc.unlock();
+}
+
+nsapi_error_t WNC14A2AInterface::set_power_saving(int window_ms, int psm_tau_s, int psm_active_s,
+                                                 int edrx_ms)
+{
+    if (window_ms < 0 || psm_tau_s < 0 || psm_active_s < 0 || edrx_ms < 0) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    start_worker();
+    _wnc.lock();
+    _wnc.setTimeout(WNC_MISC_TIMEOUT);
+
+    if (!window_ms) {
+        // writes out what is held back and keeps the modem awake
+        _tx_sched.stop();
+        _wnc.setPSM(NULL, NULL);
+        _wnc.setEDRX(NULL);
+        _wnc.unlock();
+        return NSAPI_ERROR_OK;
+    }
+
+    // writes out what is held back before the settings change
+    _tx_sched.stop();
+
+    nsapi_error_t err = NSAPI_ERROR_OK;
+    char tau[9], active[9], cycle[5];
+    if (psm_tau_s) {
+        WNCTxScheduler::tau_bits(psm_tau_s, tau);
+        WNCTxScheduler::active_bits(psm_active_s, active);
+        if (!_wnc.setPSM(tau, active)) {
+            err = NSAPI_ERROR_UNSUPPORTED;
+        }
+    }
+    if (edrx_ms) {
+        WNCTxScheduler::edrx_bits(edrx_ms, cycle);
+        if (!_wnc.setEDRX(cycle)) {
+            err = NSAPI_ERROR_UNSUPPORTED;
+        }
+    }
+
+    if (err) {
+        // nothing half applied, the modem is kept awake without windows
+        _wnc.setPSM(NULL, NULL);
+        _wnc.setEDRX(NULL);
+        _wnc.unlock();
+        tr_error("power saving: PSM/eDRX not supported by firmware %d\n", _wnc.identity().fw_version);
+        return err;
+    }
+
+    // windows still save the time the modem is kept awake without PSM or eDRX
+    _radio_clock.start();
+    _tx_sched.start(window_ms, MBED_CONF_APP_WNC_RADIO_HOLD, MBED_CONF_APP_WNC_RADIO_TAIL);
+    _wnc.unlock();
+
+    tr_info("power saving: window %d ms, tau %d s, active %d s, edrx %d ms\n",
+            window_ms, psm_tau_s, psm_active_s, edrx_ms);
+    return NSAPI_ERROR_OK;
+}
+
+void WNC14A2AInterface::get_radio_stats(WncRadioStats *stats)
+{
+    _wnc.lock();
+    *stats = _tx_sched.stats();
+    _wnc.unlock();
+}
+
+void WNC14A2AInterface::radio_activity()
+{
+    // the parser calls this before every AT command, with the channel held
+    _tx_sched.activity();
+}
+
+void WNC14A2AInterface::tx_window()
+{
+    _wnc.lock();
+    _tx_sched.run();
+    _wnc.unlock();
+}
+
+uint32_t WNC14A2AInterface::TxPort::now_ms()
+{
+    return _iface._radio_clock.read_ms();
+}
+
+void WNC14A2AInterface::TxPort::set_awake(bool awake)
+{
+    _iface._wnc.setWakeup(awake);
+}
+
+void WNC14A2AInterface::TxPort::transmit()
+{
+    // every socket with held back data, errors surface on its next send
+    for (int id = 0; id < WNC_SOCKET_COUNT; id++) {
+        struct wnc_socket *socket = _iface._handles[id];
+        if (!socket || !socket->txlen) {
+            continue;
+        }
+        nsapi_error_t err = _iface.flush(socket);
+        if (err) {
+            socket->tx_error = err;
+        }
+        _iface.socket_event(id);
+    }
+}
 
-    return size;
+bool WNC14A2AInterface::TxPort::idle()
+{
+    return _iface._wnc.idle();
+}
+
+void WNC14A2AInterface::TxPort::set_timer(uint32_t delay_ms)
+{
+    clear_timer();
+    _event = _iface._queue.call_in(delay_ms, &_iface, &WNC14A2AInterface::tx_window);
+}
+
+void WNC14A2AInterface::TxPort::clear_timer()
+{
+    if (_event) {
+        _iface._queue.cancel(_event);
+        _event = 0;
+    }
+}
+
+nsapi_error_t WNC14A2AInterface::setsockopt(nsapi_socket_t handle, int level,
+                                            int optname, const void *optval, unsigned optlen)
+{
+    struct wnc_socket *socket = (struct wnc_socket *)handle;
+    nsapi_error_t err = NSAPI_ERROR_OK;
+
+    if (level != WNC_SOCKOPT_LEVEL) {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+
+    _wnc.lock();
+    switch (optname) {
+        case WNC_SOCKOPT_COALESCE:
+            if (socket->proto != NSAPI_TCP) {
+                err = NSAPI_ERROR_UNSUPPORTED;
+            } else if (!optval || optlen != sizeof(int) || *(const int *)optval < 0) {
+                err = NSAPI_ERROR_PARAMETER;
+            } else {
+                socket->coalesce_delay = *(const int *)optval;
+                if (!socket->coalesce_delay) {
+                    err = flush(socket);
+                }
+            }
+            break;
+
+        case WNC_SOCKOPT_FLUSH:
+            err = flush(socket);
+            break;
+
+        default:
+            err = NSAPI_ERROR_UNSUPPORTED;
+            break;
+    }
+    _wnc.unlock();
+
+    return err;
 }
 
 int WNC14A2AInterface::socket_recv(void *handle, void *data, unsigned size)
 {
     struct wnc_socket *socket = (struct wnc_socket *)handle;
-    _wnc.setTimeout(WNC_RECV_TIMEOUT);
+    if (socket->proto == NSAPI_UDP) {
+        return socket_recvfrom(handle, NULL, data, size);
+    }
 
+    // never waits, TCPSocket sleeps on the sigio event until data or a close arrives
     int32_t recv = _wnc.recv(socket->id, data, size);
     if (recv < 0) {
-        return NSAPI_ERROR_WOULD_BLOCK;
+        // closed with data the modem no longer hands out, waiting would not help
+        return _wnc.is_closed(socket->id) ? NSAPI_ERROR_CONNECTION_LOST : NSAPI_ERROR_WOULD_BLOCK;
     }
 
     return recv;
 }
 
-int WNC14A2AInterface::socket_sendto(void *handle, const SocketAddress &addr, const void *data, unsigned size)
+int WNC14A2AInterface::udp_route(struct wnc_socket *socket, const SocketAddress &addr)
 {
-    struct wnc_socket *socket = (struct wnc_socket *)handle;
+    struct wnc_route *slot = NULL;
+
+    _wnc.lock();
+    for (int i = 0; i < MBED_CONF_APP_WNC_UDP_ROUTES; i++) {
+        struct wnc_route *route = &socket->routes[i];
+        if (route->id >= 0 && route->connected && route->addr == addr) {
+            route->last_used = ++_route_clock;
+            _wnc.unlock();
+            return route->id;
+        }
+    }
+
+    // prefer a modem socket we already have, then a new one
+    for (int i = 0; !slot && i < MBED_CONF_APP_WNC_UDP_ROUTES; i++) {
+        if (socket->routes[i].id >= 0 && !socket->routes[i].connected) {
+            slot = &socket->routes[i];
+        }
+    }
+    for (int i = 0; !slot && spare_id() && i < MBED_CONF_APP_WNC_UDP_ROUTES; i++) {
+        if (socket->routes[i].id < 0) {
+            int id = open_id(NSAPI_UDP);
+            if (id >= 0) {
+                slot = &socket->routes[i];
+                slot->id = id;
+                slot->connected = false;
+                _handles[id] = socket;
+            }
+            break;
+        }
+    }
+
+    // otherwise move the least recently used destination
+    if (!slot) {
+        slot = &socket->routes[0];
+        for (int i = 1; i < MBED_CONF_APP_WNC_UDP_ROUTES; i++) {
+            if (socket->routes[i].id >= 0 && socket->routes[i].last_used < slot->last_used) {
+                slot = &socket->routes[i];
+            }
+        }
 
-    if (socket->connected && socket->addr != addr) {
         _wnc.setTimeout(WNC_MISC_TIMEOUT);
-        if (!_wnc.close(socket->id)) {
+        if (!_wnc.close(slot->id)) {
+            _wnc.unlock();
             return NSAPI_ERROR_DEVICE_ERROR;
         }
-        socket->connected = false;
+        slot->connected = false;
     }
 
-    if (!socket->connected) {
-        int err = socket_connect(socket, addr);
-        if (err < 0) {
-            return err;
+    tr_debug("udp_route(id=%d, %s:%d)\n", slot->id, addr.get_ip_address(), addr.get_port());
+    _wnc.setTimeout(WNC_MISC_TIMEOUT);
+    if (!_wnc.socket_connect(slot->id, addr.get_ip_address(), addr.get_port())) {
+        _wnc.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    slot->addr = addr;
+    slot->connected = true;
+    slot->last_used = ++_route_clock;
+    _wnc.unlock();
+
+    return slot->id;
+}
+
+int WNC14A2AInterface::socket_sendto(void *handle, const SocketAddress &addr, const void *data, unsigned size)
+{
+    struct wnc_socket *socket = (struct wnc_socket *)handle;
+
+    int id = udp_route(socket, addr);
+    if (id < 0) {
+        return id;
+    }
+
+    _wnc.setTimeout(WNC_SEND_TIMEOUT);
+    int32_t sent = _wnc.send(id, data, size);
+    if (sent < 0) {
+        return _wnc.is_closed(id) ? NSAPI_ERROR_CONNECTION_LOST : NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    socket_event(socket->id);
+    return sent;
+}
+
+bool WNC14A2AInterface::spare_id()
+{
+    // modem sockets socket_open() could still get, unused or created in advance
+    int free = 0;
+    for (int i = 1; i < WNC_SOCKET_COUNT; i++) {
+        if (!_sockets[i] || _warm[i]) {
+            free++;
+        }
+    }
+    return free > 1;
+}
+
+nsapi_size_or_error_t WNC14A2AInterface::sendto_batch(wnc_datagram *msgs, unsigned count)
+{
+    WncSegment segs[WNC_BATCH_SEGMENTS];
+    unsigned index[WNC_BATCH_SEGMENTS];
+    nsapi_size_or_error_t sent = 0;
+    struct wnc_socket *batch;
+    void *handle;
+
+    _wnc.lock();
+    nsapi_error_t err = socket_open(&handle, NSAPI_UDP);
+    if (err) {
+        _wnc.unlock();
+        return err;
+    }
+    batch = (struct wnc_socket *)handle;
+
+    // WOULD_BLOCK marks datagrams not handled yet
+    for (unsigned i = 0; i < count; i++) {
+        msgs[i].result = NSAPI_ERROR_WOULD_BLOCK;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        if (msgs[i].result != NSAPI_ERROR_WOULD_BLOCK) {
+            continue;
+        }
+
+        // collect the next datagrams for this destination, in order
+        int n = 0;
+        for (unsigned j = i; j < count && n < WNC_BATCH_SEGMENTS; j++) {
+            if (msgs[j].result == NSAPI_ERROR_WOULD_BLOCK && msgs[j].address == msgs[i].address) {
+                segs[n].data = msgs[j].data;
+                segs[n].size = msgs[j].size;
+                index[n++] = j;
+            }
+        }
+
+        int id = udp_route(batch, msgs[i].address);
+        if (id < 0) {
+            for (int k = 0; k < n; k++) {
+                msgs[index[k]].result = id;
+            }
+            continue;
+        }
+
+        // stream the group, resuming after a datagram the modem refused
+        _wnc.setTimeout(WNC_SEND_TIMEOUT);
+        for (int first = 0; first < n; ) {
+            int complete = _wnc.sendv(id, segs + first, n - first);
+            for (int k = first; k < first + complete; k++) {
+                msgs[index[k]].result = msgs[index[k]].size;
+                sent++;
+            }
+            first += complete;
+            if (first < n) {
+                msgs[index[first]].result = NSAPI_ERROR_DEVICE_ERROR;
+                first++;
+            }
         }
-        socket->addr = addr;
     }
 
-    return socket_send(socket, data, size);
+    // the modem has few sockets, none are kept for the next batch
+    socket_close(batch);
+    _wnc.unlock();
+
+    return sent;
 }
 
 int WNC14A2AInterface::socket_recvfrom(void *handle, SocketAddress *addr, void *data, unsigned size)
 {
     struct wnc_socket *socket = (struct wnc_socket *)handle;
-    int ret = socket_recv(socket, data, size);
-    if (ret >= 0 && addr) {
-        *addr = socket->addr;
+    int ids[MBED_CONF_APP_WNC_UDP_ROUTES];
+    int count = 0, from = -1;
+
+    // listen on every destination this socket has talked to
+    _wnc.lock();
+    for (int i = 0; i < MBED_CONF_APP_WNC_UDP_ROUTES; i++) {
+        if (socket->routes[i].id >= 0 && socket->routes[i].connected) {
+            ids[count++] = socket->routes[i].id;
+        }
+    }
+    _wnc.unlock();
+    if (!count) {
+        ids[count++] = socket->id;
     }
 
-    return ret;
+    int32_t recv = _wnc.recv_any(ids, count, data, size, &from);
+    if (recv < 0) {
+        return _wnc.is_closed(ids[0]) && count == 1 ? NSAPI_ERROR_CONNECTION_LOST : NSAPI_ERROR_WOULD_BLOCK;
+    }
+
+    if (addr) {
+        _wnc.lock();
+        for (int i = 0; i < MBED_CONF_APP_WNC_UDP_ROUTES; i++) {
+            if (socket->routes[i].id == from) {
+                *addr = socket->routes[i].addr;
+            }
+        }
+        _wnc.unlock();
+    }
+
+    return recv;
 }
 
 void WNC14A2AInterface::socket_attach(void *handle, void (*callback)(void *), void *data)
 {
     struct wnc_socket *socket = (struct wnc_socket *)handle;
+    core_util_critical_section_enter();
     _cbs[socket->id].callback = callback;
     _cbs[socket->id].data = data;
+    core_util_critical_section_exit();
 }
 
-void WNC14A2AInterface::event() {
-    for (int i = 0; i < WNC_SOCKET_COUNT; i++) {
-        if (_cbs[i].callback) {
-            _cbs[i].callback(_cbs[i].data);
+void WNC14A2AInterface::socket_event(int id) {
+    // route sockets report through the NSAPI socket that owns them
+    if (id < 0 || id >= WNC_SOCKET_COUNT || !_handles[id]) {
+        return;
+    }
+    id = _handles[id]->id;
+
+    // called with the AT channel held, defer the callback to the worker
+    core_util_critical_section_enter();
+    _events_pending |= 1u << id;
+    bool post = !_dispatch_pending;
+    _dispatch_pending = true;
+    core_util_critical_section_exit();
+
+    if (post && !_queue.call(this, &WNC14A2AInterface::dispatch_events)) {
+        _dispatch_pending = false;
+    }
+}
+
+void WNC14A2AInterface::dispatch_events() {
+    core_util_critical_section_enter();
+    uint32_t pending = _events_pending;
+    _events_pending = 0;
+    _dispatch_pending = false;
+    core_util_critical_section_exit();
+
+    for (int id = 0; id < WNC_SOCKET_COUNT; id++) {
+        if (!(pending & (1u << id))) {
+            continue;
         }
+
+        core_util_critical_section_enter();
+        void (*callback)(void *) = _cbs[id].callback;
+        void *data = _cbs[id].data;
+        core_util_critical_section_exit();
+
+        if (callback) {
+            callback(data);
+        }
+    }
+}
+
+void WNC14A2AInterface::event() {
+    // UART rx interrupt: wake the worker once, it reads ahead outside the ISR
+    if (_worker_started && !_process_pending) {
+        _process_pending = true;
+        _queue.call(this, &WNC14A2AInterface::process);
     }
 }
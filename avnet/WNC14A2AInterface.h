@@ -29,9 +29,184 @@
 #define WNC14A2A_INTERFACE_H
 
 #include "mbed.h"
-#include "fsl_rtc.h"
 #include "WNCATParser.h"
+#include "WNCTxScheduler.h"
 
+// Socket handles are taken from a static pool, one block per modem socket
+#ifndef MBED_CONF_APP_WNC_SOCKET_POOL_COUNT
+#  define MBED_CONF_APP_WNC_SOCKET_POOL_COUNT WNC_SOCKET_COUNT
+#endif
+
+// Background worker servicing the modem between application calls
+#ifndef MBED_CONF_APP_WNC_WORKER_STACK_SIZE
+#  define MBED_CONF_APP_WNC_WORKER_STACK_SIZE 4096
+#endif
+#ifndef MBED_CONF_APP_WNC_POLL_INTERVAL
+#  define MBED_CONF_APP_WNC_POLL_INTERVAL 250
+#endif
+#define WNC_QUEUE_EVENTS 16
+
+// Period in ms at which signal quality and battery are sampled while idle, 0 turns it off
+#ifndef MBED_CONF_APP_WNC_SAMPLE_INTERVAL
+#  define MBED_CONF_APP_WNC_SAMPLE_INTERVAL 30000
+#endif
+
+// Time in ms the modem is kept awake after a transmit window or direct use
+#ifndef MBED_CONF_APP_WNC_RADIO_HOLD
+#  define MBED_CONF_APP_WNC_RADIO_HOLD 2000
+#endif
+
+// Time in ms the radio is assumed to stay connected once the modem may sleep
+#ifndef MBED_CONF_APP_WNC_RADIO_TAIL
+#  define MBED_CONF_APP_WNC_RADIO_TAIL 10000
+#endif
+
+// Period in ms after which the RTC is set from network time again
+#ifndef MBED_CONF_APP_WNC_CLOCK_RESYNC
+#  define MBED_CONF_APP_WNC_CLOCK_RESYNC 3600000
+#endif
+
+// Small TCP writes are collected up to this many bytes before one SOCKWRITE
+#ifndef MBED_CONF_APP_WNC_COALESCE_SIZE
+#  define MBED_CONF_APP_WNC_COALESCE_SIZE 512
+#endif
+
+// setsockopt() level and options specific to this driver
+#define WNC_SOCKOPT_LEVEL   0x574E
+enum wnc_sockopt {
+    WNC_SOCKOPT_COALESCE = 1,   // int: flush delay in ms, 0 turns coalescing off
+    WNC_SOCKOPT_FLUSH,          // no value: write out coalesced data now
+};
+
+/** Counters of the small-write coalescing on TCP sockets */
+struct WncCoalesceStats
+{
+    uint32_t writes_coalesced;  // socket_send() calls absorbed into a buffer
+    uint32_t flushes;           // SOCKWRITE batches issued from the buffers
+    uint32_t bytes_flushed;     // bytes carried by those batches
+};
+
+/** One datagram of a WNC14A2AInterface::sendto_batch() call */
+struct wnc_datagram
+{
+    SocketAddress address;          // destination
+    const void *data;
+    unsigned size;
+    nsapi_size_or_error_t result;   // bytes sent or error, filled in by sendto_batch()
+};
+
+// Datagrams per destination written in one pass of sendto_batch()
+#define WNC_BATCH_SEGMENTS 16
+
+// Destinations a UDP socket keeps connected modem sockets for. Only WNC_SOCKET_COUNT - 1
+// modem sockets exist, so an extra one is only taken while another stays free for
+// socket_open(), and all of them are released when the socket is closed
+#ifndef MBED_CONF_APP_WNC_UDP_ROUTES
+#  define MBED_CONF_APP_WNC_UDP_ROUTES 3
+#endif
+
+// Modem sockets kept created ahead of socket_open() while the link is up
+#ifndef MBED_CONF_APP_WNC_WARM_TCP
+#  define MBED_CONF_APP_WNC_WARM_TCP 1
+#endif
+#ifndef MBED_CONF_APP_WNC_WARM_UDP
+#  define MBED_CONF_APP_WNC_WARM_UDP 0
+#endif
+
+// Hostnames resolved by gethostbyname(), TTLs in seconds, 0 disables caching
+#ifndef MBED_CONF_APP_WNC_DNS_CACHE_SIZE
+#  define MBED_CONF_APP_WNC_DNS_CACHE_SIZE 4
+#endif
+#ifndef MBED_CONF_APP_WNC_DNS_TTL
+#  define MBED_CONF_APP_WNC_DNS_TTL 300
+#endif
+#ifndef MBED_CONF_APP_WNC_DNS_NEGATIVE_TTL
+#  define MBED_CONF_APP_WNC_DNS_NEGATIVE_TTL 30
+#endif
+#define WNC_DNS_HOST_SIZE 64
+#define WNC_DNS_QUERIES 4
+
+// Thread running gethostbyname_async() lookups and their callbacks
+#ifndef MBED_CONF_APP_WNC_DNS_STACK_SIZE
+#  define MBED_CONF_APP_WNC_DNS_STACK_SIZE 2048
+#endif
+
+/** Completion of gethostbyname_async(), result is 0 or a negative error code
+ *  and address is null unless the name was resolved
+ */
+typedef Callback<void(nsapi_error_t result, SocketAddress *address)> wnc_hostbyname_cb_t;
+
+/** Counters of the gethostbyname() cache */
+struct WncDnsStats
+{
+    uint32_t hits;              // lookups answered with a cached address
+    uint32_t negative_hits;     // lookups answered with a cached failure
+    uint32_t misses;            // lookups that went to the modem
+    uint32_t flushes;           // times the cache was dropped for a link change
+};
+
+/** A hostname cached by gethostbyname(), unused while host is empty */
+struct wnc_dns_entry {
+    char host[WNC_DNS_HOST_SIZE];
+    char ip[16];                // empty for a cached failure
+    uint32_t expires;           // DNS clock in ms
+};
+
+/** A gethostbyname_async() request waiting for the DNS thread */
+struct wnc_dns_query {
+    char host[WNC_DNS_HOST_SIZE];
+    nsapi_version_t version;
+    wnc_hostbyname_cb_t callback;   // null for a prefetch or once cancelled
+    int event;                      // queued DNS thread event
+    uint32_t generation;            // bumped each time the slot is taken
+    bool running;                   // the DNS thread is resolving it
+    bool in_use;
+};
+
+/** A modem socket connected to one destination of a UDP socket */
+struct wnc_route {
+    int id;                     // modem socket id, -1 if the slot is unused
+    bool connected;
+    SocketAddress addr;
+    uint32_t last_used;         // route clock value of the last send
+};
+
+struct wnc_socket {
+    int id;
+    nsapi_protocol_t proto;
+    bool connected;
+    SocketAddress addr;
+
+    // UDP only: destinations with their own modem socket, routes[0] uses id
+    struct wnc_route routes[MBED_CONF_APP_WNC_UDP_ROUTES];
+
+    // small-write coalescing, see WNC_SOCKOPT_COALESCE
+    int coalesce_delay;         // ms before buffered data is flushed, 0 when off
+    int flush_event;            // pending flush on the worker queue, 0 if none
+    nsapi_error_t tx_error;     // failure of a deferred flush, reported on the next send
+    unsigned txlen;
+    char txbuf[MBED_CONF_APP_WNC_COALESCE_SIZE];
+};
+
+/** Steps of connect(), each one reported through the status callback */
+enum wnc_connect_state {
+    WNC_CONNECT_IDLE,           // not connected, or the last attempt failed
+    WNC_CONNECT_STARTING,       // probing or restarting the modem
+    WNC_CONNECT_REGISTERING,    // waiting for network registration
+    WNC_CONNECT_ATTACHING,      // bringing up the PDN context
+    WNC_CONNECT_PDN_UP,         // context has an address, finishing setup
+    WNC_CONNECT_GLOBAL_UP,      // ready for sockets
+};
+
+// registration/attach attempts of one connect()
+#define WNC_CONNECT_TRIES 3
+
+/** How much of the modem state a reconnect() may throw away */
+enum wnc_recovery {
+    WNC_RECOVER_REATTACH,       // register and bring up the context again
+    WNC_RECOVER_CFUN,           // cycle the radio with AT+CFUN first
+    WNC_RECOVER_RESET,          // restart the modem
+};
 
 /** WNC14A2AInterface class
  *  Implementation of the NetworkStack for the WNC14A2A GSM Modem
@@ -86,9 +261,48 @@ public:
     /**
     * Connect to the network
     *
+    * In non-blocking mode this only starts the connection, the steps then
+    * run on the driver worker and are reported through the status callback.
+    *
+    * @return 0 on success or once started, negative error code on failure
     */
     virtual int connect();
 
+    /** Choose whether connect() waits for the link
+     *
+     *  @param blocking true to wait (default), false to return at once
+     *  @return         0 on success
+     */
+    virtual nsapi_error_t set_blocking(bool blocking);
+
+    /** Register a callback for connection status changes
+     *
+     *  It is called with NSAPI_EVENT_CONNECTION_STATUS_CHANGE on every
+     *  step of connect(), get_connect_state() tells which step it is.
+     *
+     *  @param status_cb    Called with the event and the nsapi_connection_status_t
+     */
+    virtual void attach(Callback<void(nsapi_event_t, intptr_t)> status_cb);
+
+    /** Get the connection status
+     *  @return             Status mapped from the current connect() step
+     */
+    virtual nsapi_connection_status_t get_connection_status() const;
+
+    /** Get the step connect() is at */
+    wnc_connect_state get_connect_state() const;
+
+    /** Start a connection in the background, escalating only as far as asked
+     *
+     *  Like a non-blocking connect(), but a modem that is not usable as it
+     *  is gets re-attached or its radio cycled before it is restarted.
+     *  A modem that was never started is always restarted.
+     *
+     *  @param level    Most disruptive step that may be tried first
+     *  @return         0 once started, negative error code on failure
+     */
+    nsapi_error_t reconnect(wnc_recovery level);
+
     bool is_connected();
 
     /** Start the interface
@@ -132,6 +346,17 @@ public:
     */
     const char *get_imei();
 
+    /** Get the module identity (IMEI, ICCID, firmware) read since the last modem reset
+     *  @param identity     Destination for the identity, empty strings for what is not known yet
+     */
+    void get_identity(WncIdentity *identity);
+
+    /** Check whether the modem firmware is known to support a feature
+     *  @param feature      One of the WNC_FEATURE_* bits
+     *  @return             true if supported, false if not or not known yet
+     */
+    bool has_feature(uint32_t feature);
+
     /**
      * Get the Latitude, Longitude, Date and Time of the device
      *
@@ -142,10 +367,54 @@ public:
      */
     bool get_location_date(char *lon, char *lat, tm *datetime, int *zone = 0);
 
+    /** Get the local date and time from the RTC
+     *
+     *  The worker sets the RTC from network time once registered, again every
+     *  wnc-clock-resync ms and when the network reports a new time zone.
+     *  time() returns UTC once this succeeds.
+     *
+     *  @param datetime     Local date and time, tm_year from 1900 and tm_mon from 0
+     *  @param zone         Local time offset in quarter hours, may be null
+     *  @return             false if the RTC was not set from network time yet
+     */
+    bool get_date_time(tm *datetime, int *zone = 0);
+
+    /** Get the state of the RTC sync
+     *  @param status       Destination for the state
+     */
+    void get_clock_status(WncClockStatus *status);
+
+    /** Let the modem sleep between periodic transmit windows
+     *
+     *  Sends on sockets with WNC_SOCKOPT_COALESCE set are held back until
+     *  the next window instead of their coalescing delay. Any other AT
+     *  command wakes the modem at once, and it is only let to sleep again
+     *  once nothing is left to read from it. PSM and eDRX are requested from the network where
+     *  the firmware supports them, the network may grant other values.
+     *  If the firmware does not support what is requested, see wnc-fw-psm
+     *  and wnc-fw-edrx, power saving is left off and windows are not started.
+     *
+     *  @param window_ms    Time between transmit windows, 0 turns power saving off
+     *  @param psm_tau_s    Periodic TAU to request in seconds, 0 for no PSM
+     *  @param psm_active_s Active time to request in seconds
+     *  @param edrx_ms      eDRX cycle to request in milliseconds, 0 for no eDRX
+     *  @return             0 on success, NSAPI_ERROR_UNSUPPORTED if PSM or eDRX
+     *                      was requested and is not supported, negative error code on failure
+     */
+    nsapi_error_t set_power_saving(int window_ms, int psm_tau_s = 0, int psm_active_s = 0,
+                                   int edrx_ms = 0);
+
+    /** Get the estimated radio-on time and sleep ratio since power saving was turned on
+     *
+     *  @param stats    Destination for the counters
+     */
+    void get_radio_stats(WncRadioStats *stats);
+
     bool queryIP(const char *url, const char *theIP);
 
     /**
      * Get the Battery status, level and voltage of the device
+     * Answered from the background sampler once it has run, see get_signal()
      *
      * @param status battery status
      * @param level battery level
@@ -154,6 +423,22 @@ public:
      */
     bool getModemBattery(uint8_t *status, int *level, int *voltage);
 
+    /** Get the signal quality and battery as last sampled in the background
+     *
+     *  Never talks to the modem, check signal_ms/battery_ms for the age.
+     *
+     *  @param status   Destination for the samples
+     */
+    void get_signal(WncSignalStatus *status);
+
+    /** Change how often signal quality and battery are sampled
+     *
+     *  Samples are only taken while the AT channel is idle.
+     *
+     *  @param interval_ms  Sampling period, 0 stops sampling
+     */
+    void set_sample_interval(int interval_ms);
+
     /** Translates a hostname to an IP address with specific version
      *
      *  The hostname may be either a domain name or an IP address. If the
@@ -178,6 +463,104 @@ public:
      */
     using NetworkInterface::add_dns_server;
 
+    /** Translate a hostname on the driver DNS thread
+     *
+     *  Literal addresses and cached names complete immediately, with the
+     *  callback called before this returns. A name cached as unresolvable
+     *  fails immediately, only returning the error without calling the
+     *  callback. Otherwise the lookup is queued
+     *  and the callback is called from the DNS thread, so a slow lookup
+     *  does not hold up the worker.
+     *
+     *  @param name     Hostname to resolve
+     *  @param callback Called with the result
+     *  @param version  IP version of address to resolve
+     *  @return         0 on immediate completion, negative error code on
+     *                  failure, or a positive id that can be passed to
+     *                  gethostbyname_async_cancel()
+     */
+    nsapi_error_t gethostbyname_async(const char *name, wnc_hostbyname_cb_t callback,
+                                      nsapi_version_t version = NSAPI_UNSPEC);
+
+    /** Cancel a queued gethostbyname_async() request
+     *
+     *  The lookup may still complete and fill the cache, the callback is
+     *  not called any more.
+     *
+     *  @param id       Id returned by gethostbyname_async()
+     *  @return         0 on success, negative error code on failure
+     */
+    nsapi_error_t gethostbyname_async_cancel(int id);
+
+    /** Resolve a hostname in the background so a later connect finds it cached
+     *
+     *  Meant to be called right after connect() for the servers the
+     *  application is about to use.
+     *
+     *  @param name     Hostname to resolve
+     *  @return         0 on success, negative error code if it could not be queued
+     */
+    nsapi_error_t prefetch_hostname(const char *name);
+
+    /** Get the usage statistics of the driver memory pools
+     *
+     *  @param sockets  Destination for the socket pool statistics or null
+     *  @param packets  Destination for the received packet pool statistics or null
+     */
+    void get_pool_stats(WncPoolStats *sockets, WncPoolStats *packets);
+
+    /** Send several UDP datagrams with as few AT exchanges as possible
+     *
+     *  Datagrams are grouped by destination. The driver connects its batch
+     *  socket once per destination and writes that group back to back,
+     *  keeping the order of datagrams to the same destination. The batch
+     *  socket and its modem sockets are released before this returns.
+     *
+     *  @param msgs     Datagrams to send, each result field is filled in
+     *  @param count    Number of datagrams
+     *  @return         Number of datagrams sent completely, or negative error
+     *                  code if the batch socket could not be opened
+     */
+    nsapi_size_or_error_t sendto_batch(wnc_datagram *msgs, unsigned count);
+
+    /** Get the small-write coalescing counters
+     *
+     *  @param stats    Destination for the counters
+     */
+    void get_coalesce_stats(WncCoalesceStats *stats);
+
+    /** Get how many received bytes were decoded straight into the
+     *  application's buffer and how many went through the packet queue
+     *
+     *  @param stats    Destination for the counters
+     */
+    void get_recv_stats(WncRecvStats *stats);
+
+    /** Get the PDN context details the interface has cached
+     *
+     *  @param stats    Destination for the context details
+     *  @return         0 on success, NSAPI_ERROR_NO_CONNECTION if no context is known to be up
+     */
+    nsapi_error_t get_ip_stats(WncIpStats *stats);
+
+    /** Get the DNS cache counters
+     *
+     *  @param stats    Destination for the counters
+     */
+    void get_dns_stats(WncDnsStats *stats);
+
+    /** Get how long the last modem startup spent in each phase
+     *
+     *  @param stats    Destination for the timings
+     */
+    void get_boot_stats(WncBootStats *stats);
+
+    /** Get the registration state and serving cell reported by the modem
+     *
+     *  @param status   Destination for the state
+     */
+    void get_registration(WncRegStatus *status);
+
 protected:
     /** Open a socket
      *  @param handle       Handle in which to store new socket
@@ -273,10 +656,28 @@ protected:
      *  @param handle       Socket handle
      *  @param callback     Function to call on state change
      *  @param data         Argument to pass to callback
-     *  @note Callback may be called in an interrupt context.
+     *  @note Callback is only called when data, a completed write or a close is
+     *        reported for this socket. It runs on the driver worker thread, so
+     *        it may call back into the socket API.
      */
     virtual void socket_attach(void *handle, void (*callback)(void *), void *data);
 
+    /** Set a socket option
+     *
+     *  WNC_SOCKOPT_LEVEL/WNC_SOCKOPT_COALESCE with an int delay in ms turns on
+     *  small-write coalescing for a TCP socket, WNC_SOCKOPT_FLUSH writes out
+     *  whatever has been collected.
+     *
+     *  @param handle   Socket handle
+     *  @param level    Option level
+     *  @param optname  Level-specific option name
+     *  @param optval   Option value
+     *  @param optlen   Length of the option value
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t setsockopt(nsapi_socket_t handle, int level,
+                                     int optname, const void *optval, unsigned optlen);
+
     /** Provide access to the NetworkStack object
      *
      *  @return The underlying NetworkStack object
@@ -286,6 +687,9 @@ protected:
     }
 
 private:
+    friend class WNCConnectionManager;
+    friend class WNCLinkSupervisor;
+
     WNCATParser _wnc;
     bool _sockets[WNC_SOCKET_COUNT];
 
@@ -294,6 +698,96 @@ private:
     char _passPhrase[10];
     char _imei[16];
 
+    WNCPool<struct wnc_socket, MBED_CONF_APP_WNC_SOCKET_POOL_COUNT> _socket_pool;
+
+    // worker thread and its queue use static storage
+    uint64_t _worker_stack[MBED_CONF_APP_WNC_WORKER_STACK_SIZE / sizeof(uint64_t)];
+    unsigned char _queue_buffer[WNC_QUEUE_EVENTS * EVENTS_EVENT_SIZE];
+    Thread _worker;
+    EventQueue _queue;
+    uint64_t _dns_stack[MBED_CONF_APP_WNC_DNS_STACK_SIZE / sizeof(uint64_t)];
+    unsigned char _dns_queue_buffer[WNC_DNS_QUERIES * 2 * EVENTS_EVENT_SIZE];
+    Thread _dns_thread;
+    EventQueue _dns_queue;
+    bool _worker_started;
+    volatile bool _process_pending;
+    int _sample_interval;
+    int _sample_event;
+    bool _sample_deferred;      // a sample round skipped while the modem slept
+
+    // sockets with a notification waiting for the worker, one bit per id
+    volatile uint32_t _events_pending;
+    volatile bool _dispatch_pending;
+
+    struct wnc_socket *_handles[WNC_SOCKET_COUNT];
+    uint32_t _route_clock;
+
+    // modem ids created in advance, WNC_TCP/WNC_UDP or 0 if not warm
+    int _warm[WNC_SOCKET_COUNT];
+    bool _link_up;
+
+    volatile wnc_connect_state _connect_state;
+    wnc_recovery _recovery;
+    uint32_t _link_generation;  // parser link generation when the link came up
+    int _connect_tries;
+    bool _blocking;
+    Callback<void(nsapi_event_t, intptr_t)> _status_cb;
+    bool _refill_pending;
+    WncCoalesceStats _coalesce_stats;
+
+    // how the transmit scheduler reaches the modem and the worker
+    class TxPort : public WNCRadioPort {
+    public:
+        TxPort(WNC14A2AInterface &iface) : _iface(iface), _event(0) {}
+        virtual uint32_t now_ms();
+        virtual void set_awake(bool awake);
+        virtual void transmit();
+        virtual bool idle();
+        virtual void set_timer(uint32_t delay_ms);
+        virtual void clear_timer();
+    private:
+        WNC14A2AInterface &_iface;
+        int _event;
+    };
+    TxPort _tx_port;
+    WNCTxScheduler _tx_sched;
+    Timer _radio_clock;
+
+    struct wnc_dns_entry _dns[MBED_CONF_APP_WNC_DNS_CACHE_SIZE];
+    WncDnsStats _dns_stats;
+    uint32_t _dns_generation;   // parser link generation the cache was filled in
+    Timer _dns_clock;
+    struct wnc_dns_query _dns_queries[WNC_DNS_QUERIES];
+
+    void start_worker();
+    int link_ready();
+    void set_connect_state(wnc_connect_state state);
+    nsapi_error_t start_connect(wnc_recovery level);
+    nsapi_error_t post_connect();
+    void check_link();
+    nsapi_error_t connect_step();
+    void connect_event();
+    void process();
+    void sample();
+    void sync_clock();
+    // write out coalesced data, on failure the unsent tail stays buffered
+    nsapi_error_t flush(struct wnc_socket *socket);
+    int open_id(nsapi_protocol_t proto);
+    void release_id(int id);
+    void refill_warm();
+    void drop_warm();
+    int udp_route(struct wnc_socket *socket, const SocketAddress &addr);
+    bool spare_id();
+    bool socket_closed(void *handle);
+    struct wnc_dns_entry *dns_lookup(const char *name);
+    void dns_store(const char *name, const char *ip);
+    void dns_flush();
+    void dns_resolve(int index, uint32_t generation);
+    void flush_event(int id);
+    void tx_window();
+    void radio_activity();
+    void socket_event(int id);
+    void dispatch_events();
     void event();
 
     struct {
@@ -28,6 +28,18 @@ MyBuffer<T>::MyBuffer(uint32_t size)
 {
     _buf = new T [size];
     _size = size;
+    _owned = true;
+    clear();
+    
+    return;
+}
+
+template <class T>
+MyBuffer<T>::MyBuffer(T *storage, uint32_t size)
+{
+    _buf = storage;
+    _size = size;
+    _owned = false;
     clear();
     
     return;
@@ -36,7 +48,9 @@ MyBuffer<T>::MyBuffer(uint32_t size)
 template <class T>
 MyBuffer<T>::~MyBuffer()
 {
-    delete [] _buf;
+    if (_owned) {
+        delete [] _buf;
+    }
     
     return;
 }
@@ -65,12 +65,19 @@ private:
     volatile uint32_t   _wloc;
     volatile uint32_t   _rloc;
     uint32_t            _size;
+    bool                _owned;
 
 public:
     /** Create a Buffer and allocate memory for it
      *  @param size The size of the buffer
      */
     MyBuffer(uint32_t size = 0x100);
+
+    /** Create a Buffer on top of caller provided storage, nothing is allocated
+     *  @param storage Memory for at least size elements, must outlive the buffer
+     *  @param size The size of the buffer
+     */
+    MyBuffer(T *storage, uint32_t size);
     
     /** Get the size of the ring buffer
      * @return the size of the ring buffer
@@ -34,6 +34,15 @@ BufferedSerial::BufferedSerial(PinName tx, PinName rx, uint32_t buf_size, uint32
     return;
 }
 
+BufferedSerial::BufferedSerial(PinName tx, PinName rx, char *rxbuf, char *txbuf, uint32_t buf_size, uint32_t tx_multiple, const char* name)
+    : RawSerial(tx, rx) , _rxbuf(rxbuf, buf_size), _txbuf(txbuf, (uint32_t)(tx_multiple*buf_size))
+{
+    RawSerial::attach(this, &BufferedSerial::rxIrq, Serial::RxIrq);
+    this->_buf_size = buf_size;
+    this->_tx_multiple = tx_multiple;   
+    return;
+}
+
 BufferedSerial::~BufferedSerial(void)
 {
     RawSerial::attach(NULL, RawSerial::RxIrq);
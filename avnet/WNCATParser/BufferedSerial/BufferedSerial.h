@@ -92,6 +92,18 @@ public:
      *  @note Either tx or rx may be specified as NC if unused
      */
     BufferedSerial(PinName tx, PinName rx, uint32_t buf_size = 256, uint32_t tx_multiple = 4,const char* name=NULL);
+
+    /** Create a BufferedSerial port using caller provided ring buffer storage
+     *  @param tx Transmit pin
+     *  @param rx Receive pin
+     *  @param rxbuf storage for the rx ring buffer, buf_size bytes
+     *  @param txbuf storage for the tx ring buffer, tx_multiple*buf_size bytes
+     *  @param buf_size printf() buffer size
+     *  @param tx_multiple amount of max printf() present in the internal ring buffer at one time
+     *  @param name optional name
+     *  @note Nothing is allocated from the heap, the storage must outlive the port
+     */
+    BufferedSerial(PinName tx, PinName rx, char *rxbuf, char *txbuf, uint32_t buf_size = 256, uint32_t tx_multiple = 4, const char* name=NULL);
     
     /** Destroy a BufferedSerial port
      */
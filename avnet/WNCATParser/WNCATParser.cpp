@@ -23,14 +23,13 @@
  */
 
 #include <cctype>
-#include <fsl_rtc.h>
-#include <string>
 #include "WNCATParser.h"
 #include "mbed-trace/mbed_trace.h"
 
 #define TRACE_GROUP "wncATP"
 
-#ifdef NCIODEBUG
+// the zero-heap build leaves out the printf based I/O debug as well
+#if defined(NCIODEBUG) || MBED_CONF_APP_WNC_ZERO_HEAP
 #  define CIODUMP(buffer, size)
 #  define CIODEBUG(...)
 #  define CSTDEBUG(...)
@@ -43,8 +42,7 @@
 #endif
 
 #define GSM_UART_BAUD_RATE 115200
-#define RXTX_BUFFER_SIZE   1500
-#define MAX_SEND_BYTES     1400
+#define UART_TX_MULTIPLE   4
 
 DigitalOut  mdm_uart2_rx_boot_mode_sel(PTC17);  // on powerup, 0 = boot mode, 1 = normal boot
 DigitalOut  mdm_power_on(PTB9);                 // 0 = modem on, 1 = modem off (hold high for >5 seconds to cycle modem)
@@ -53,14 +51,52 @@ DigitalOut  mdm_reset(PTC12);                   // active high
 DigitalOut  shield_3v3_1v8_sig_trans_ena(PTC4); // 0 = disabled (all signals high impedence, 1 = translation active
 DigitalOut  mdm_uart1_cts(PTD0);
 
+// Holds the AT channel for the scope of a command exchange
+class ChannelLock {
+public:
+    ChannelLock(Mutex &mutex) : _mutex(mutex) {
+        _mutex.lock();
+    }
+    ~ChannelLock() {
+        _mutex.unlock();
+    }
+private:
+    Mutex &_mutex;
+};
+
+#if MBED_CONF_APP_WNC_ZERO_HEAP
+// UART ring buffers live in .bss instead of being allocated by MyBuffer
+static char uart_rx_storage[RXTX_BUFFER_SIZE];
+static char uart_tx_storage[RXTX_BUFFER_SIZE * UART_TX_MULTIPLE];
+#endif
 
 WNCATParser::WNCATParser(PinName txPin, PinName rxPin, PinName rstPin, PinName pwrPin)
-    : _serial(txPin, rxPin, RXTX_BUFFER_SIZE), _powerPin(pwrPin), _resetPin(rstPin),  _packets(0), _packets_end(&_packets) 
+#if MBED_CONF_APP_WNC_ZERO_HEAP
+    : _serial(txPin, rxPin, uart_rx_storage, uart_tx_storage, RXTX_BUFFER_SIZE, UART_TX_MULTIPLE), _powerPin(pwrPin),
+#else
+    : _serial(txPin, rxPin, RXTX_BUFFER_SIZE, UART_TX_MULTIPLE), _powerPin(pwrPin),
+#endif
+      _resetPin(rstPin),  _packets(0), _packets_end(&_packets) 
 {
     tr_warn("WNC [--] init\r\n");
     _serial.baud(GSM_UART_BAUD_RATE);
     _powerPin = 0;
     _initialized = false;
+    memset(&_signal, 0, sizeof(_signal));
+    _signal.rssi = _signal.ber = 99;
+    _signal.dbm = _signal.rsrp = _signal.rsrq = WNC_DBM_UNKNOWN;
+    _clock.start();
+    memset(&_time, 0, sizeof(_time));
+    _time_stale = false;
+    _time_attempt_ms = 0;
+    _link_generation = 0;
+    _ip_valid = false;
+    memset(_sock, 0, sizeof(_sock));
+    memset(&_recv_stats, 0, sizeof(_recv_stats));
+    memset(&_boot_stats, 0, sizeof(_boot_stats));
+    memset(&_reg, 0, sizeof(_reg));
+    _reg.creg = _reg.cereg = _reg.act = -1;
+    memset(&_identity, 0, sizeof(_identity));
 }
 
 bool WNCATParser::hard_reset(void) {
@@ -68,6 +104,11 @@ bool WNCATParser::hard_reset(void) {
    // the signal level translator)
    mdm_reset = 0;
 
+   // a new power cycle may come up with other firmware or another SIM
+   _cache_mutex.lock();
+   memset(&_identity, 0, sizeof(_identity));
+   _cache_mutex.unlock();
+
    // disable signal level translator (necessary
    // for the modem to boot properly).  All signals
    // except mdm_reset go through the level translator
@@ -95,29 +136,40 @@ bool WNCATParser::hard_reset(void) {
 
 
 bool WNCATParser::startup(void) {
+    ChannelLock lock(_smutex);
     tr_debug("WNC [--] startup\r\n");
+    Timer timer;
+    timer.start();
 
    hard_reset();
+   _link_generation++;
 
-   wait_ms(2000);
+   // let the lines settle before the first probe, the boot itself is polled
+   wait_ms(WNC_RESET_SETTLE);
+   uint32_t reset_ms = timer.read_ms();
 
+   // the modem is polled until it answers instead of sleeping through its boot
    bool success = reset();
+   _boot_stats.reset_ms = reset_ms;
 
    _initialized = success;
    return success;
 }
 
 bool WNCATParser::powerDown(void) {
+    ChannelLock lock(_smutex);
    bool normalPowerDown = tx("AT@SHUTDOWN") && rx("OK", 20);
    _powerPin =  0;
    return normalPowerDown;
 }
 
 bool WNCATParser::isModemAlive() {
+    ChannelLock lock(_smutex);
    return (tx("AT") && rx("OK"));
 }
 
 int WNCATParser::checkGPRS() {
+    ChannelLock lock(_smutex);
    int val = -1;
    if (!isModemAlive())
       return false;
@@ -127,69 +179,244 @@ int WNCATParser::checkGPRS() {
 }
 
 bool WNCATParser::reset(void) {
-    //char response[4];
-    char response[70];
-    //int val = -1;
-	 int ret = 0;
+    ChannelLock lock(_smutex);
+    Timer timer;
+    timer.start();
 
-    bool modemOn = false;
-    for (int tries = 0; !modemOn && tries < 10; tries++) {
-        tr_warn("WNC [--] !! reset (%d)\r\n", tries);
+    _cache_mutex.lock();
+    memset(&_boot_stats, 0, sizeof(_boot_stats));
+    _cache_mutex.unlock();
+    bool modemOn = _wait_ready(WNC_BOOT_TIMEOUT);
+    _boot_stats.ready_ms = timer.read_ms();
 
+    if (modemOn) {
+        modemOn = _configure();
+    }
+    _boot_stats.configure_ms = timer.read_ms() - _boot_stats.ready_ms;
 
-        // see if the modem replies health first
-        if (isModemAlive()) return true;
-			wait_ms(500);
+    tr_info("WNC [--] ready %s after %u ms (%u probes), configured in %u ms\r\n",
+            _boot_stats.boot_urc ? "(boot URC)" : "", (unsigned int)_boot_stats.ready_ms,
+            (unsigned int)_boot_stats.probes, (unsigned int)_boot_stats.configure_ms);
+    return modemOn;
+}
 
-        // TODO check if need delay here to wait for boot
-        // Emit AT looking for AT or OK (echo potentially enabled)
-        for (int i = 0; !modemOn && i < 1; i++) {
-            modemOn = (tx("AT") && scan("%2s", &response)
-                       && (!strncmp("AT", response, 2) || !strncmp("OK", response, 2)));
+bool WNCATParser::_wait_ready(uint32_t timeout_ms) {
+    char response[64];
+    uint32_t backoff = WNC_PROBE_MIN;
+    Timer timer;
+    timer.start();
 
-            wait_ms(500);
+    while ((uint32_t)timer.read_ms() < timeout_ms) {
+        // Emit AT looking for OK, echo may still be enabled
+        _serial.puts("AT\r\n");
+        _boot_stats.probes++;
+
+        Timer gap;
+        gap.start();
+        while (true) {
+            // read once, a second read could pass backoff and wrap the remainder
+            uint32_t elapsed = gap.read_ms();
+            if (elapsed >= backoff) {
+                break;
+            }
+            if (!_readline_ms(response, sizeof(response) - 1, backoff - elapsed)) {
+                break;
+            }
+            CIODEBUG("GSM (%02d) -> '%s'\r\n", strlen(response), response);
+
+            if (!strncmp("OK", response, 2)) {
+                return true;
+            }
+
+            // anything else but our echo means the modem is up, ask again right away
+            if (strncmp("AT", response, 2)) {
+                checkURC(response);
+                _boot_stats.boot_urc = true;
+                backoff = WNC_PROBE_MIN;
+                break;
+            }
+        }
+
+        if (gap.read_ms() >= (int)backoff) {
+            backoff = backoff * 2 < WNC_PROBE_MAX ? backoff * 2 : WNC_PROBE_MAX;
         }
     }
 
-    if (modemOn) {
-        // TODO check if the parser ignores any lines it doesn't expect
-        // disable echo
-        modemOn = tx("ATE0") && scan("%3s", response)  // echo off
-                  && (!strncmp("ATE0", response, 3) || !strncmp("OK", response, 2));
-
-         tx("AT+CMEE=2") && rx("\%CMEEU: 2") && rx("OK"); // 2 - verbose error, 1 - numeric error, 0 - just ERROR
-
-        //ret = tx("AT&V") && rx("OK");
-  		  // Get firmware version
-  		  //tx("AT+GMR") && scan("MPSS: %60s", response) && rx("OK");
-  		  tx("AT+GMR") && readline(response, 60, 5) && rx("OK");
-		  tr_debug("%s\n", response);
-
-  		  //tx("AT+QNWINFO") && scan("%60s", response) && rx("OK");
-		  //tr_debug("%s\n", response);
-  		  //tx("AT%%CCID") && scan("%60s", response) && rx("OK");
-		  //tr_debug("%s\n", response);
-        
-		  //ret |= tx("AT%%CMATT=0") && rx("OK");
-		  //ret |= tx("AT+COPS?") && rx("OK");
-		  //ret |= tx("AT%%CMATT=1") && rx("OK");
-
-		  ret |= tx("AT+CMGF=1") && rx("OK");
-        
-        //RDL:  TODO these are broken
-        //ret |= tx("AT+CPMS?") && rx("OK");
-        //ret |= tx("AT+CPMS=SM,SM,SM") && rx("OK");
-        
-
-/*TODO Do we need to save the setting profile
-        tx("AT&W");
-        rx("OK");*/
+    tr_error("WNC [--] no answer after %u probes\r\n", (unsigned int)_boot_stats.probes);
+    return false;
+}
+
+bool WNCATParser::_configure(void) {
+    char response[70];
+    int ret = 0;
+
+    // TODO check if the parser ignores any lines it doesn't expect
+    // disable echo
+    bool modemOn = tx("ATE0") && scan("%3s", response)  // echo off
+                   && (!strncmp("ATE0", response, 3) || !strncmp("OK", response, 2));
+
+    tx("AT+CMEE=2") && rx("\%CMEEU: 2") && rx("OK"); // 2 - verbose error, 1 - numeric error, 0 - just ERROR
+
+    _read_identity();
+
+    //tx("AT+QNWINFO") && scan("%60s", response) && rx("OK");
+    //tx("AT%%CCID") && scan("%60s", response) && rx("OK");
+
+    ret |= tx("AT+CMGF=1") && rx("OK");
+
+    // registration changes and the serving cell arrive as URCs from now on
+    _cache_mutex.lock();
+    _reg.creg = _reg.cereg = _reg.act = -1;
+    _cache_mutex.unlock();
+    _ip_valid = false;
+    ret |= tx("AT+CREG=2") && rx("OK");
+    ret |= tx("AT+CEREG=2") && rx("OK");
+
+    // the modem clock follows NITZ and time zone changes are reported
+    if (hasFeature(WNC_FEATURE_NITZ)) {
+        ret |= tx("AT+CTZU=1") && rx("OK");
+        ret |= tx("AT+CTZR=1") && rx("OK");
     }
+
+    //RDL:  TODO these are broken
+    //ret |= tx("AT+CPMS?") && rx("OK");
+    //ret |= tx("AT+CPMS=SM,SM,SM") && rx("OK");
+
     return modemOn;
 }
 
+void WNCATParser::_read_identity(void) {
+    if (!_identity.firmware[0]) {
+        // MPSS: M14A2A_v11.50.164451 APSS: M14A2A_v11.53.164451
+        char response[sizeof(_identity.firmware)];
+        if (tx("AT+GMR") && readline(response, sizeof(response), 5) && rx("OK")) {
+            response[sizeof(response) - 1] = '\0';
+
+            int major, minor;
+            uint32_t version = 0, features = 0;
+            const char *v = strstr(response, "_v");
+            if (v && sscanf(v + 2, "%d.%d", &major, &minor) == 2) {
+                version = major * 100 + minor;
+            }
+            if (WNC_FW_CESQ && version >= WNC_FW_CESQ) features |= WNC_FEATURE_CESQ;
+            if (WNC_FW_NITZ && version >= WNC_FW_NITZ) features |= WNC_FEATURE_NITZ;
+            if (WNC_FW_PSM && version >= WNC_FW_PSM)   features |= WNC_FEATURE_PSM;
+            if (WNC_FW_EDRX && version >= WNC_FW_EDRX) features |= WNC_FEATURE_EDRX;
+
+            _cache_mutex.lock();
+            strcpy(_identity.firmware, response);
+            _identity.fw_version = version;
+            _identity.features = features;
+            _cache_mutex.unlock();
+            tr_info("firmware %s (features %02lx)\n", response, (unsigned long)features);
+        }
+    }
+
+    if (!_identity.imei[0]) {
+        _read_imei();
+    }
+}
+
+bool WNCATParser::_read_imei(void) {
+    char imei[sizeof(_identity.imei)];
+    if (!(tx("AT+GSN") && scan("%15s", imei) && rx("OK"))) {
+        return false;
+    }
+    ChannelLock cache(_cache_mutex);
+    strcpy(_identity.imei, imei);
+    return true;
+}
+
+WncIdentity WNCATParser::identity() {
+    ChannelLock cache(_cache_mutex);
+    return _identity;
+}
+
+bool WNCATParser::hasFeature(uint32_t feature) {
+    return (_identity.features & feature) == feature;
+}
+
+WncRegStatus WNCATParser::registration() {
+    ChannelLock cache(_cache_mutex);
+    return _reg;
+}
+
+// +CREG: [<n>,]<stat>[,"<lac>","<ci>"[,<AcT>]], the query reply carries <n>
+void WNCATParser::_update_reg(int *stat, const char *args) {
+    char *end;
+    int value = strtol(args, &end, 10);
+    if (end == args) {
+        return;
+    }
+    if (end[0] == ',' && isdigit((unsigned char)end[1])) {
+        args = end + 1;
+        value = strtol(args, &end, 10);
+    }
+
+    _cache_mutex.lock();
+    bool changed = *stat != value;
+    *stat = value;
+
+    if (end[0] == ',' && end[1] == '"') {
+        uint32_t area = strtoul(end + 2, &end, 16);
+        if (end[0] == '"' && end[1] == ',' && end[2] == '"') {
+            uint32_t cell = strtoul(end + 3, &end, 16);
+            changed |= area != _reg.area || cell != _reg.cell;
+            _reg.area = area;
+            _reg.cell = cell;
+            if (end[0] == '"' && end[1] == ',') {
+                _reg.act = strtol(end + 2, NULL, 10);
+            }
+        }
+    }
+
+    if (changed && !_registered()) {
+        _ip_valid = false;
+    }
+    if (changed) {
+        _reg.changes++;
+    }
+    _cache_mutex.unlock();
+
+    if (changed) {
+        tr_debug("registration creg=%d cereg=%d area=%lx cell=%lx\n", _reg.creg, _reg.cereg,
+                 (unsigned long)_reg.area, (unsigned long)_reg.cell);
+    }
+}
+
+bool WNCATParser::_registered(void) {
+    // 1 - home network, 5 - roaming
+    return _reg.creg == 1 || _reg.creg == 5 || _reg.cereg == 1 || _reg.cereg == 5;
+}
+
+bool WNCATParser::_wait_registered(uint32_t timeout_ms) {
+    Timer timer;
+    timer.start();
+
+    // one query catches a state that will not be reported again
+    tx("AT+CREG?") && rx("OK");
+    tx("AT+CEREG?") && rx("OK");
+
+    while (!_registered()) {
+        int left = (int)timeout_ms - timer.read_ms();
+        if (left <= 0) {
+            return false;
+        }
+        if (_readline_ms(_line, sizeof(_line) - 1, left) && checkURC(_line) == -1) {
+            tr_debug("GSM -> '%s' (ignored)\n", _line);
+        }
+    }
+    return true;
+}
+
+WncBootStats WNCATParser::boot_stats() {
+    ChannelLock cache(_cache_mutex);
+    return _boot_stats;
+}
+
 
 bool WNCATParser::requestDateTime() {
+    ChannelLock lock(_smutex);
 
     bool tdStatus = false;
 
@@ -198,110 +425,34 @@ bool WNCATParser::requestDateTime() {
                 && tx("AT+CFUN=1") && rx("OK", 10)
                 && tx("AT+CCLK=\"17/05/19,16:37:54+00\"")&& rx("OK"));
 
-    bool connected = false;
-    for (int networkTries = 0; !connected && networkTries < 20; networkTries++) {
-        int bearer = -1, status = -1;
-        if (tx("AT+CGREG?") && scan("+CGREG: %d,%d", &bearer, &status) && rx("OK", 15)) {
-            // TODO add an enum of status codes
-            connected = status == 1 || status == 5;
-        }
-        // TODO check if we need to use thread wait
-        wait_ms(1000);
-    }
+    bool connected = _wait_registered(20000);
     tdStatus &= (tx("AT+QNTP=\"pool.ntp.org\"") && rx("OK"));
 
     return tdStatus && connected;
 }
 
-bool WNCATParser::connect(const char *apn, const char *userName, const char *passPhrase) {
+bool WNCATParser::registerNetwork(uint32_t timeout_ms) {
+    ChannelLock lock(_smutex);
     // TODO implement setting the pin number, add it to the contructor arguments
 
-    bool connected = false, attached = false;
-
-    //TODO do we need timeout here
-    for (int tries = 0; !connected && !attached && tries < 3; tries++) {
-
-        int rawRSSI, ber;
-        tx("AT+CSQ") && scan("+CSQ: %d,%d", &rawRSSI, &ber) && rx("OK");
-        tr_debug("rawRSSI/ber: %d, %d\n", rawRSSI, ber);
-
-         // check if SIM is locked
-        tx("AT+CPIN?") && rx("OK");
-
-        // connect to the mobile network
-        //for (int networkTries = 0; !connected && networkTries < 20; networkTries++) {
-        for (int networkTries = 0; !connected && networkTries < 5; networkTries++) {
-            int bearer = -1, status = -1;
-            if (tx("AT+CREG?") && scan("+CREG: %d,%d", &bearer, &status) && rx("OK", 10)) {
-            //if (tx("AT+CREG=2") && scan("+CREG: %d,%d", &bearer, &status) && rx("OK", 10)) {
-                // TODO add an enum of status codes
-                connected = status == 1 || status == 5;
-                //if (status == 3)
-                //  tx("AT+CFUN=1") && rx("OK");
-            }
-            // TODO check if we need to use thread wait
-            wait_ms(1000);
-        }
-        if (!connected) continue;
-
-        // Convert WNC RSSI into dBm range:
-        //  0 - -113 dBm
-        //  1 - -111 dBm
-        //  2..30 - -109 to -53 dBm
-        //  31 - -51dBm or >
-        //  99 - not known or not detectable
-       /*
-           if (rawRssi == 99)
-         *dBm = -199;
-         else if (rawRssi == 0)
-         *dBm = -113;
-         else if (rawRssi == 1)
-         *dBm = -111;
-         else if (rawRssi == 31)
-         *dBm = -51; 
-         else if (rawRssi >= 2 && rawRssi <= 30)
-         *dBm = -113 + 2 * rawRssi;
-         else {
-         dbgPuts("Invalid RSSI!");
-         return (false);
-         }
-         */
-
+    sampleSignal();
 
-        // attach GPRS
-        //if (!(tx("AT+QIDEACT") && rx("DEACT OK"))) continue;
-        // activate cid
-        //tx("AT+CGACT?") && rx("OK");
-        //if (!(tx("AT+CGACT=1,1") && rx("OK"))) continue;
+     // check if SIM is locked
+    tx("AT+CPIN?") && rx("OK");
 
-        /*
-        for (int attachTries = 0; !attached && attachTries < 20; attachTries++) {
-            attached = tx("AT+CGATT=1") && rx("OK", 10);
-            wait_ms(2000);
-        }
-        if (!attached) continue;
-        tr_info("Attached");
-        */
+    // connect to the mobile network, woken by the registration URCs
+    return _wait_registered(timeout_ms);
+}
 
-        // set APN and finish setup
-        //attached =
-        //    tx("AT+QIFGCNT=0") && rx("OK") &&
-        //    tx("AT+QICSGP=1,\"%s\",\"%s\",\"%s\"", apn, userName, passPhrase) && rx("OK", 10) &&
-        //    tx("AT+QIREGAPP") && rx("OK", 10) &&
-        //    tx("AT+QIACT") && rx("OK", 10);
-        // RDL:  TODO  PDNSET will also take userName and passPhrase
-        tx("AT%%PDNSET=1,%s,IP", apn) && rx("OK", 10);
-                     //tx("AT+CGACT=1") && rx("OK", 10);
+void WNCATParser::activatePDN(const char *apn, const char *userName, const char *passPhrase) {
+    ChannelLock lock(_smutex);
 
-        
-  		  tx("AT@INTERNET=1") && rx("OK");
-  		  tx("AT@SOCKDIAL=1") && rx("OK");
-    }
+    // RDL:  TODO  PDNSET will also take userName and passPhrase
+    tx("AT%%PDNSET=1,%s,IP", apn) && rx("OK", 10);
+                 //tx("AT+CGACT=1") && rx("OK", 10);
 
-    // Send request to get the local time
-    //attached &= requestDateTime();
-
-    return connected && attached ;
+    tx("AT@INTERNET=1") && rx("OK");
+    tx("AT@SOCKDIAL=1") && rx("OK");
 }
 
 bool WNCATParser::disconnect(void) {
@@ -311,49 +462,78 @@ bool WNCATParser::disconnect(void) {
     return true;
 }
 
+// copies the field up to the next comma into dest (16 bytes), NULL if it is not there
 char *parse_dotstring(char *start, char *dest) {
-   char *ptr, *ptr2;
-   int size;
-
-   ptr = start;
-   ptr2 = strchr(ptr, ',');
-   size = ptr2-ptr;
-   memcpy(dest, ptr, size);
-   dest[size] = '\0';
+   char *ptr2 = start ? strchr(start, ',') : NULL;
+   if (!ptr2 || ptr2 - start >= 16) {
+      return NULL;
+   }
 
+   memcpy(dest, start, ptr2 - start);
+   dest[ptr2 - start] = '\0';
    return ptr2;
 }
 
-void parse_ipstats(char *response, struct WncIpStats *ipstats) {
+bool parse_ipstats(char *response, struct WncIpStats *ipstats) {
    char *ptr, *ptr2;
    int size;
 
+   memset(ipstats, 0, sizeof(*ipstats));
+   // <cid>,<bearer_id>,"<apn>",...
+   sscanf(response, "%d,%d", &ipstats->cid, &ipstats->bearerid);
+
    // skip preamble
    //ptr = strchr(response, ' ');
    //printf("%s\n",ptr++);
 
+   // a defined but inactive context has no address fields after the APN
    ptr = strchr(response, '\"');
-   ptr +=1;
-   ptr = strchr(ptr, '\"');
+   ptr = ptr ? strchr(ptr + 1, '\"') : NULL;
+   if (!ptr || ptr[1] != ',') {
+      return false;
+   }
    ptr +=2;
 
+   // address and mask share one field, the address ends at its fourth dot
    ptr2 = strchr(ptr, '.');
-   ptr2 = strchr(ptr2+1, '.');
-   ptr2 = strchr(ptr2+1, '.');
-   ptr2 = strchr(ptr2+1, '.');
+   for (int i = 0; i < 3 && ptr2; i++) {
+      ptr2 = strchr(ptr2 + 1, '.');
+   }
+   if (!ptr2) {
+      return false;
+   }
    size = ptr2-ptr;
+   if (size >= (int)sizeof(ipstats->ipaddr) || memchr(ptr, ',', size)) {
+      return false;
+   }
    memcpy(ipstats->ipaddr, ptr, size);
    ipstats->ipaddr[size] = '\0';
 
    ptr = parse_dotstring(ptr2+1, ipstats->mask);
-   ptr = parse_dotstring(ptr+1, ipstats->gateway);
-   ptr = parse_dotstring(ptr+1, ipstats->dnsPrimary);
-   ptr = parse_dotstring(ptr+1, ipstats->dnsSecondary);
+   ptr = ptr ? parse_dotstring(ptr+1, ipstats->gateway) : NULL;
+   ptr = ptr ? parse_dotstring(ptr+1, ipstats->dnsPrimary) : NULL;
+   ptr = ptr ? parse_dotstring(ptr+1, ipstats->dnsSecondary) : NULL;
+   return true;
 }
 
 const char *WNCATParser::getIPAddress(void) {
-   
-    tr_debug("getIPAddress()\n");
+    // answered from the last +CGCONTRDP until a URC or socket error says otherwise
+    {
+        ChannelLock cache(_cache_mutex);
+        if (_ip_valid && _registered()) {
+            return _ip_buffer;
+        }
+    }
+
+    ChannelLock lock(_smutex);
+    return _queryIPAddress();
+}
+
+const char *WNCATParser::_queryIPAddress(void) {
+    ChannelLock lock(_smutex);
+
+    tr_debug("_queryIPAddress()\n");
+    _ip_valid = false;
     if(!_initialized) {
        tr_error("not initialized\n");
        return NULL;
@@ -362,7 +542,7 @@ const char *WNCATParser::getIPAddress(void) {
     char buffer[256];
     //int size;
     tx("AT+CGCONTRDP=1");
-    if (scan("+CGCONTRDP: %256s", buffer) == 0) {
+    if (scan("+CGCONTRDP: %255s", buffer) <= 0) {
         tr_error("getIPAddress: not connected\n");
         return NULL;
     }
@@ -375,65 +555,101 @@ const char *WNCATParser::getIPAddress(void) {
 
     rx("OK");
 
-    parse_ipstats(buffer, &_ipstats);
-    printf("cid: %d\n",_ipstats.cid);
-    printf("bid: %d\n",_ipstats.bearerid);
-    printf("ip:  %s\n",_ipstats.ipaddr);
-    printf("mask:%s\n",_ipstats.mask);
-    printf("gw:  %s\n",_ipstats.gateway);
-    printf("dns1:%s\n",_ipstats.dnsPrimary);
-    printf("dns2:%s\n",_ipstats.dnsSecondary);
+    struct WncIpStats ipstats;
+    if (!parse_ipstats(buffer, &ipstats)) {
+       tr_error("getIPAddress: no address in '%s'\n", buffer);
+       return NULL;
+    }
+    tr_debug("cid=%d bid=%d ip=%s mask=%s gw=%s dns=%s,%s\n", ipstats.cid, ipstats.bearerid,
+             ipstats.ipaddr, ipstats.mask, ipstats.gateway, ipstats.dnsPrimary, ipstats.dnsSecondary);
 
+    ChannelLock cache(_cache_mutex);
+    _ipstats = ipstats;
     strcpy(_ip_buffer, _ipstats.ipaddr);
+    _ip_valid = true;
     return _ip_buffer;
 }
 
+bool WNCATParser::ip_stats(WncIpStats *stats) {
+    ChannelLock cache(_cache_mutex);
+    if (!_ip_valid || !_registered()) {
+        return false;
+    }
+    *stats = _ipstats;
+    return true;
+}
+
 bool WNCATParser::getIMEI(char *getimei) {
-    if (!(tx("AT+GSN") && scan("%s", _imei))) {
+    ChannelLock lock(_smutex);
+    if (!_identity.imei[0] && !_read_imei()) {
         return 0;
     }
-    strncpy(getimei, _imei, 16);
+    strncpy(getimei, _identity.imei, sizeof(_identity.imei) - 1);
+    getimei[sizeof(_identity.imei) - 1] = '\0';
     return 1;
 }
 
 bool WNCATParser::getICCID(char *geticcid) {
-    if (!(tx("AT%%CCID") && scan("%%CCID: %s", _iccid))) {
-        return 0;
+    ChannelLock lock(_smutex);
+    if (!_identity.iccid[0]) {
+        char iccid[sizeof(_identity.iccid)];
+        if (!(tx("AT%%CCID") && scan("%%CCID: %20s", iccid) && rx("OK"))) {
+            return 0;
+        }
+        ChannelLock cache(_cache_mutex);
+        strcpy(_identity.iccid, iccid);
     }
-    strncpy(geticcid, _iccid, 16);
+    strncpy(geticcid, _identity.iccid, sizeof(_identity.iccid) - 1);
+    geticcid[sizeof(_identity.iccid) - 1] = '\0';
     return 1;
 }
 
 bool WNCATParser::getLocation(char *lon, char *lat, tm *datetime, int *zone) {
+    ChannelLock lock(_smutex);
 
     char response[32] = "";
 
-    string responseLon;
-    string responseLat;
-
     // get location - +QCELLLOC: Longitude, Latitude
-    if (!(tx("AT+QCELLLOC=1") && scan("+QCELLLOC: %s", response) && rx("OK")))
+    if (!(tx("AT+QCELLLOC=1") && scan("+QCELLLOC: %31s", response) && rx("OK")))
         return false;
 
-    string str(response);
-    size_t found = str.find(",");
-    if (found <= 0) return false;
+    // split in place, no temporaries
+    char *comma = strchr(response, ',');
+    if (!comma || comma == response) return false;
 
-    responseLon = str.substr(0, found - 1);
-    responseLat = str.substr(found + 1);
-    strcpy(lon, responseLon.c_str());
-    strcpy(lat, responseLat.c_str());
+    *comma = '\0';
+    strcpy(lon, response);
+    strcpy(lat, comma + 1);
 
-    // get network time
-    if (!((tx("AT+CCLK?")) && (scan("+CCLK: \"%d/%d/%d,%d:%d:%d+%d\"",
-                                    &datetime->tm_year, &datetime->tm_mon, &datetime->tm_mday,
-                                    &datetime->tm_hour, &datetime->tm_min, &datetime->tm_sec,
-                                    &zone))) && rx("OK")){
+    // network time, from the RTC once it was synced
+    if (!_time.synced && !syncClock()) {
         CSTDEBUG("WNC [--] !! no time received\r\n");
         return false;
     }
-    if (datetime->tm_mon == 05 && datetime->tm_year == 17)
+    return getDateTime(datetime, zone);
+}
+
+bool WNCATParser::syncClock(void) {
+    ChannelLock lock(_smutex);
+    tm datetime;
+    int tz = 0;
+
+    memset(&datetime, 0, sizeof(datetime));
+
+    // +CCLK: "yy/MM/dd,hh:mm:ss[+-]zz", local time and its offset in quarter hours
+    if (!(tx("AT+CCLK?") && (scan("+CCLK: \"%d/%d/%d,%d:%d:%d%d\"",
+                                  &datetime.tm_year, &datetime.tm_mon, &datetime.tm_mday,
+                                  &datetime.tm_hour, &datetime.tm_min, &datetime.tm_sec,
+                                  &tz) == 7) && rx("OK"))) {
+        _time_attempt_ms = _clock.read_ms() | 1;
         return false;
+    }
+
+    // still the placeholder requestDateTime() writes, no network time yet
+    if (datetime.tm_mon == 05 && datetime.tm_year == 17) {
+        _time_attempt_ms = _clock.read_ms() | 1;
+        return false;
+    }
 
     //    int tm_sec;			/* Seconds.	[0-60] (1 leap second) */
     //    int tm_min;			/* Minutes.	[0-59] */
@@ -451,19 +667,153 @@ bool WNCATParser::getLocation(char *lon, char *lat, tm *datetime, int *zone) {
      * year + 200 > gives us current year - 1900 = 100
      * So in this case add 100 to the year received from WNC
      */
-    datetime->tm_year += 100;
+    datetime.tm_year += 100;
     /* calculate months from 0*/
-    datetime->tm_mon -= 1;
+    datetime.tm_mon -= 1;
+
+    // the RTC keeps UTC, the zone is applied when reading it back
+    set_time(mktime(&datetime) - tz * 15 * 60);
+
+    _cache_mutex.lock();
+    _time.synced = true;
+    _time.zone = tz;
+    _time.synced_ms = _clock.read_ms();
+    _time.syncs++;
+    _cache_mutex.unlock();
+    _time_stale = false;
+    _time_attempt_ms = 0;
+
+    tr_info("RTC set to %d/%d/%d %d:%d:%d (zone %d)\n",
+            datetime.tm_year + 1900, datetime.tm_mon + 1, datetime.tm_mday,
+            datetime.tm_hour, datetime.tm_min, datetime.tm_sec, tz);
+    return true;
+}
+
+bool WNCATParser::clockDue(uint32_t max_age_ms) {
+    uint32_t now = _clock.read_ms();
+
+    // after a failure leave the modem alone for a while
+    if (_time_attempt_ms && now - _time_attempt_ms < WNC_CLOCK_RETRY) {
+        return false;
+    }
+    return !_time.synced || _time_stale || now - _time.synced_ms >= max_age_ms;
+}
+
+bool WNCATParser::getDateTime(tm *datetime, int *zone) {
+    if (!_time.synced) {
+        return false;
+    }
 
-    CSTDEBUG("WNC [--] !! %d/%d/%d::%d:%d:%d::%d\r\n",
-             datetime->tm_year, datetime->tm_mon, datetime->tm_mday,
-             datetime->tm_hour, datetime->tm_min, datetime->tm_sec,
-             *zone);
+    int tz = _time.zone;
+    time_t local = time(NULL) + tz * 15 * 60;
+    gmtime_r(&local, datetime);
+    if (zone) *zone = tz;
     return true;
 }
 
+WncClockStatus WNCATParser::clock_status() {
+    ChannelLock cache(_cache_mutex);
+    return _time;
+}
+
+bool WNCATParser::setPSM(const char *tau, const char *active) {
+    ChannelLock lock(_smutex);
+    if (!tau) {
+        return tx("AT+CPSMS=0") && rx("OK");
+    }
+    if (!hasFeature(WNC_FEATURE_PSM)) {
+        return false;
+    }
+    return tx("AT+CPSMS=1,,,\"%s\",\"%s\"", tau, active) && rx("OK");
+}
+
+bool WNCATParser::setEDRX(const char *cycle) {
+    ChannelLock lock(_smutex);
+    if (!cycle) {
+        return tx("AT+CEDRXS=0") && rx("OK");
+    }
+    if (!hasFeature(WNC_FEATURE_EDRX)) {
+        return false;
+    }
+    // 4 - E-UTRAN
+    return tx("AT+CEDRXS=1,4,\"%s\"", cycle) && rx("OK");
+}
+
+void WNCATParser::setWakeup(bool awake) {
+    mdm_wakeup_in = awake ? 1 : 0;
+}
+
 bool WNCATParser::modem_battery(uint8_t *status, int *level, int *voltage) {
-    return (tx("AT+CBC") && scan("+CBC: %d,%d,%d", status, level, voltage));
+    ChannelLock lock(_smutex);
+    if (!sampleBattery()) {
+        return false;
+    }
+    *status = _signal.bat_status;
+    *level = _signal.bat_level;
+    *voltage = _signal.bat_voltage;
+    return true;
+}
+
+// Convert WNC RSSI into dBm range:
+//  0 - -113 dBm
+//  1 - -111 dBm
+//  2..30 - -109 to -53 dBm
+//  31 - -51dBm or >
+//  99 - not known or not detectable
+static int rssi_to_dbm(int rawRssi) {
+    if (rawRssi < 0 || rawRssi > 31) {
+        return WNC_DBM_UNKNOWN;
+    }
+    return -113 + 2 * rawRssi;
+}
+
+bool WNCATParser::sampleSignal(void) {
+    ChannelLock lock(_smutex);
+    int rawRSSI = 99, ber = 99;
+
+    if (!(tx("AT+CSQ") && scan("+CSQ: %d,%d", &rawRSSI, &ber) && rx("OK"))) {
+        return false;
+    }
+
+    // +CESQ: <rxlev>,<ber>,<rscp>,<ecno>,<rsrq>,<rsrp>, 255 if not known
+    int rxlev, cber, rscp, ecno, rsrq = 255, rsrp = 255;
+    if (hasFeature(WNC_FEATURE_CESQ)
+        && !(tx("AT+CESQ") && scan("+CESQ: %d,%d,%d,%d,%d,%d", &rxlev, &cber, &rscp, &ecno, &rsrq, &rsrp)
+             && rx("OK"))) {
+        rsrq = rsrp = 255;
+    }
+
+    _cache_mutex.lock();
+    _signal.rssi = rawRSSI;
+    _signal.ber = ber;
+    _signal.dbm = rssi_to_dbm(rawRSSI);
+    _signal.rsrq = rsrq <= 34 ? -20 + rsrq / 2 : WNC_DBM_UNKNOWN;
+    _signal.rsrp = rsrp <= 97 ? -141 + rsrp : WNC_DBM_UNKNOWN;
+    _signal.signal_ms = _clock.read_ms();
+    _cache_mutex.unlock();
+    tr_debug("rssi/ber: %d, %d (%d dBm), rsrp %d, rsrq %d\n", rawRSSI, ber, _signal.dbm,
+             _signal.rsrp, _signal.rsrq);
+    return true;
+}
+
+bool WNCATParser::sampleBattery(void) {
+    ChannelLock lock(_smutex);
+    int status, level, voltage;
+
+    if (!(tx("AT+CBC") && scan("+CBC: %d,%d,%d", &status, &level, &voltage) && rx("OK"))) {
+        return false;
+    }
+    ChannelLock cache(_cache_mutex);
+    _signal.bat_status = status;
+    _signal.bat_level = level;
+    _signal.bat_voltage = voltage;
+    _signal.battery_ms = _clock.read_ms();
+    return true;
+}
+
+WncSignalStatus WNCATParser::signal_status() {
+    ChannelLock cache(_cache_mutex);
+    return _signal;
 }
 
 bool WNCATParser::isConnected(void) {
@@ -471,34 +821,88 @@ bool WNCATParser::isConnected(void) {
     return getIPAddress() != 0;
 }
 
-bool WNCATParser::queryIP(const char *url, char *theIP) {
+bool WNCATParser::probeLink(void) {
+    ChannelLock lock(_smutex);
+    int attached = 0;
 
+    // nothing to reuse before the first startup
+    if (!_initialized) {
+        return false;
+    }
+
+    if (!(tx("AT") && rx("OK", 1))) {
+        tr_debug("probeLink: modem not answering\n");
+        return false;
+    }
+
+    if (!(tx("AT+CGATT?") && scan("+CGATT: %d", &attached) && rx("OK")) || !attached) {
+        tr_debug("probeLink: not attached\n");
+        return false;
+    }
+
+    return _queryIPAddress() != NULL;
+}
+
+bool WNCATParser::isInitialized(void) {
+    return _initialized;
+}
+
+bool WNCATParser::isRegistered(void) {
+    return _registered();
+}
+
+bool WNCATParser::cycleRadio(void) {
+    ChannelLock lock(_smutex);
+    if (!_initialized) {
+        return false;
+    }
+
+    tr_debug("cycleRadio()\n");
+    _link_generation++;
+    _cache_mutex.lock();
+    _reg.creg = _reg.cereg = -1;
+    _ip_valid = false;
+    _cache_mutex.unlock();
+    return tx("AT+CFUN=0") && rx("OK", 15) && tx("AT+CFUN=1") && rx("OK", 15);
+}
+
+bool WNCATParser::queryIP(const char *url, char *theIP) {
    tr_debug("queryIP(url=%s)\n", url);
     for(int i = 0; i < 3; i++) {
-        char *quote;
-        char response[64];
-        tx("AT@DNSRESVDON=\"%s\"", url);
-
-        while(1) {
-            readline(response, 64, 10);
-            if (!strncmp("OK", response, 2))
-               return true;
-
-            if (!strncmp("ERROR", response, 5))
-               return false;
-            
-            sscanf(response, "@DNSRESVDON:\"%s\"", theIP);
-            quote = strchr(theIP, '\"');
-            *quote = 0;
-            tr_debug("IP: %s\n", theIP);
-        }
-        
+        // the AT channel is only held for one attempt, others get it in between
+        {
+            ChannelLock lock(_smutex);
+            char response[64];
+            bool found = false;
+            tx("AT@DNSRESVDON=\"%s\"", url);
+
+            // a silent modem ends the attempt instead of spinning on an empty line
+            while (readline(response, 64, 10)) {
+                if (!strncmp("OK", response, 2))
+                   return found;
+
+                if (!strncmp("ERROR", response, 5))
+                   return false;
+
+                // @DNSRESVDON:"a.b.c.d"
+                char *start = strchr(response, '\"');
+                char *end = start ? strchr(start + 1, '\"') : NULL;
+                if (!strncmp("@DNSRESVDON:", response, 12) && end && end - start - 1 < 16) {
+                    memcpy(theIP, start + 1, end - start - 1);
+                    theIP[end - start - 1] = 0;
+                    found = true;
+                    tr_debug("IP: %s\n", theIP);
+                }
+            }
+        }
+
         wait(1);
     }
     return false;
 }
 
 bool WNCATParser::open(nsapi_protocol_t type, int id) {
+    ChannelLock lock(_smutex);
     int id_resp = -1;
 
     tr_debug("open(type=%s, id=%d\n",type == NSAPI_UDP ? "UDP" : "TCP",id);
@@ -515,6 +919,8 @@ bool WNCATParser::open(nsapi_protocol_t type, int id) {
 
           if (id != id_resp) return false; //fail
 
+          _purge(id);
+          _sock[id].datagram = type == NSAPI_UDP;
           return true;
        }
     }
@@ -524,6 +930,7 @@ bool WNCATParser::open(nsapi_protocol_t type, int id) {
 }
 
 bool WNCATParser::socket_connect(int id, const char *addr, int port) {
+    ChannelLock lock(_smutex);
 
     tr_debug("socket_connect(id=%d, addr=%s, port=%d)\n",id,addr,port);
     if (!id) return false;
@@ -540,12 +947,15 @@ bool WNCATParser::socket_connect(int id, const char *addr, int port) {
           return true;
     }
 
+    // the context may be gone, have the next getIPAddress() ask the modem
+    _ip_valid = false;
+
     //TODO return a error code to debug the open fail in a better way
     return false;
 }
 
 
-void itohex(char *str, uint8_t *data, unsigned int data_length)
+void itohex(char *str, const uint8_t *data, unsigned int data_length)
 {
 	char const hex_chars[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
 
@@ -557,44 +967,137 @@ void itohex(char *str, uint8_t *data, unsigned int data_length)
 	}
 }
 
-bool WNCATParser::send(int id, const void *data, uint32_t amount) {
-   bool ret = false;
+static void hextobin(uint8_t *data, const char *str, uint32_t data_length)
+{
+	for( uint32_t i = 0; i < data_length; ++i ) {
+		uint8_t byte = 0;
+		for( int n = 0; n < 2; ++n ) {
+			char c = *str++;
+			byte <<= 4;
+			if( c >= '0' && c <= '9' ) byte |= c - '0';
+			else if( c >= 'A' && c <= 'F' ) byte |= c - 'A' + 10;
+			else if( c >= 'a' && c <= 'f' ) byte |= c - 'a' + 10;
+		}
+		*data++ = byte;
+	}
+}
 
-   tr_debug("send(id=%d, amount=%d)\n", id, (int)amount);
-    //if (!(tx("AT+QISRVC=1") && rx("OK"))) return false;
+int32_t WNCATParser::send(int id, const void *data, uint32_t amount) {
+    WncSegment segment = { data, amount, 0 };
+
+    tr_debug("send(id=%d, amount=%d)\n", id, (int)amount);
+    if (!amount) {
+        return 0;
+    }
+
+    sendv(id, &segment, 1);
+    if (!segment.sent) {
+        _ip_valid = false;
+        return -1;
+    }
+    return (int32_t)segment.sent;
+}
 
-    uint8_t *tempData = (uint8_t *) data;
-    uint32_t remainingAmount = amount;
-    int sendDataSize = 0;
-    while (remainingAmount > 0) {
-        sendDataSize = remainingAmount < MAX_SEND_BYTES ?  remainingAmount : MAX_SEND_BYTES;
-        remainingAmount -= sendDataSize;
+// size of the chunk starting at offset in segment seg, skipping empty segments
+static uint32_t chunk_at(const WncSegment *segs, int count, int &seg, uint32_t offset) {
+    while (seg < count && offset >= segs[seg].size) {
+        seg++;
+        offset = 0;
+    }
+    if (seg >= count) {
+        return 0;
+    }
 
-         tr_debug("send(sendDataSize=%d, remainingAmount=%d)\n", (int)sendDataSize, remainingAmount);
+    uint32_t size = segs[seg].size - offset;
+    return size < MAX_SEND_BYTES ? size : MAX_SEND_BYTES;
+}
 
-        /* TODO if this retry is required?
-         * TODO May take a second try if device is busy
-         * TODO use QISACK after you receive SEND OK, to check if whether the data has been sent to the remote
-         */
-        for (int i = 0; i < 2; i++) {
-            // dump binary
-				CIODUMP((uint8_t *) tempData, (size_t)sendDataSize);
+int WNCATParser::sendv(int id, WncSegment *segs, int count) {
+    ChannelLock lock(_smutex);
 
-            // binary to hex string
-            char numStr[RXTX_BUFFER_SIZE];
-            itohex(numStr, tempData, sendDataSize);
-            numStr[sendDataSize * 2] = '\0';
+    for (int i = 0; i < count; i++) {
+        segs[i].sent = 0;
+    }
 
-            // write to socket
-            int wrote;
-            ret = tx("AT@SOCKWRITE=%d,%d,\"%s\"", id, sendDataSize, numStr) && 
-                  scan("@SOCKWRITE:%d",&wrote) && rx("OK");
+    int seg = 0;              // segment of the chunk in flight
+    uint32_t offset = 0;      // start of the chunk in that segment
+    int cur = 0;              // _txhex slot holding the chunk in flight
 
-            if (ret && (wrote == sendDataSize)) break;
-        } //for:i
-        tempData += sendDataSize;
-    }//while
-    return true;
+    uint32_t chunk = chunk_at(segs, count, seg, offset);
+    if (chunk) {
+        itohex(_txhex[cur], (const uint8_t *) segs[seg].data, chunk);
+    }
+
+    while (chunk) {
+        const uint8_t *bytes = (const uint8_t *) segs[seg].data;
+
+        // a chunk never spans segments, so each segment starts its own SOCKWRITE
+        int nseg = seg;
+        uint32_t noffset = offset + chunk;
+        if (noffset >= segs[seg].size) {
+            nseg++;
+            noffset = 0;
+        }
+        uint32_t next = chunk_at(segs, count, nseg, noffset);
+        if (next && nseg != seg) {
+            noffset = 0;
+        }
+
+        tr_debug("send(sendDataSize=%d, segment=%d)\n", (int)chunk, seg);
+        CIODUMP(bytes + offset, (size_t)chunk);
+
+        uint32_t done = 0;
+        bool encoded = false;
+        bool failed = false;
+        for (int tries = 0; !failed && done < chunk && tries < WNC_SEND_RETRIES; ) {
+            // the command drains from the UART ring by interrupt ...
+            txsimple("AT@SOCKWRITE=%d,%d,\"", id, (int)(chunk - done));
+            _serial.write(_txhex[cur] + 2 * done, 2 * (chunk - done));
+            _serial.write("\"\r\n", 3);
+
+            // ... so encode the following chunk while this one is on the wire
+            if (!encoded && next) {
+                itohex(_txhex[!cur], (const uint8_t *) segs[nseg].data + noffset, next);
+            }
+            encoded = true;
+
+            int wrote = 0;
+            if (scan("@SOCKWRITE:%d", &wrote) != 1) {
+                tries++;
+                continue;
+            }
+
+            // the modem took these bytes, sending them again after a lost OK
+            // would duplicate them on the stream
+            if (wrote > 0) {
+                done += (uint32_t)wrote < chunk - done ? (uint32_t)wrote : chunk - done;
+            } else {
+                tries++;
+            }
+            if (!rx("OK")) {
+                tr_error("send(id=%d) no OK after @SOCKWRITE:%d\n", id, wrote);
+                failed = true;
+            }
+        }
+
+        segs[seg].sent += done;
+        if (failed || done < chunk) {
+            tr_error("send(id=%d) short write, %u of %u bytes\n", id,
+                     (unsigned int)segs[seg].sent, (unsigned int)segs[seg].size);
+            break;
+        }
+
+        seg = nseg;
+        offset = noffset;
+        chunk = next;
+        cur = !cur;
+    }
+
+    int complete = 0;
+    while (complete < count && segs[complete].sent == segs[complete].size) {
+        complete++;
+    }
+    return complete;
 }
 
 /*TODO Use this commmand to get the IP status before running IP commands(open, send, ..)
@@ -616,125 +1119,342 @@ void WNCATParser::_packet_handler(const char *response) {
    return;
 }
 
+void WNCATParser::_unlink(struct packet **p) {
+   struct packet *q = *p;
+   if (_packets_end == &q->next) {
+      _packets_end = p;
+   }
+   *p = q->next;
+   _sock[q->id].buffered -= q->len;
+   _packet_pool.free(q);
+}
+
 int32_t WNCATParser::_check_queue(int id, void *data, uint32_t amount) {
-   // check if any packets are ready for us
-   for (struct packet **p = &_packets; *p; p = &(*p)->next) {
-      tr_debug("Inspect packet (id=%d)\n",(*p)->id);
-      if ((*p)->id == id) {
-            struct packet *q = *p;
-
-            tr_debug("Packet ready: id=%d len=%d\n",(*p)->id, (int)q->len);
-            if (q->len <= amount) { // Return and remove full packet
-               memcpy(data, q->data, q->len);
-
-               // dump binary data
-               //CIODUMP((uint8_t *) data, (size_t)q->len);
-
-               if (_packets_end == &(*p)->next) {
-                  _packets_end = p;
-               }
-               *p = (*p)->next;
-
-               uint32_t len = q->len;
-               free(q);
-               return len;
-            } else { // return only partial packet
-               memcpy(data, q->data, amount);
-
-               q->len -= amount;
-               memmove(q->data, (uint8_t *) q->data + amount, q->len);
-
-               return amount;
-            }
+   uint32_t copied = 0;
+
+   // blocks of one SOCKREAD chunk are queued back to back, the last one is marked
+   struct packet **p = &_packets;
+   while (*p && copied < amount) {
+      struct packet *q = *p;
+      if (q->id != id) {
+         p = &q->next;
+         continue;
+      }
+
+      tr_debug("Packet ready: id=%d len=%d\n", q->id, (int)q->len);
+      uint32_t n = q->len < amount - copied ? q->len : amount - copied;
+      memcpy((uint8_t *) data + copied, q->data, n);
+      copied += n;
+
+      if (n < q->len && !_sock[id].datagram) {
+         // the stream goes on from here with the next call
+         q->len -= n;
+         memmove(q->data, (uint8_t *) q->data + n, q->len);
+         _sock[id].buffered -= n;
+         break;
+      }
+
+      bool last = q->last;
+      _unlink(p);
+      if (_sock[id].datagram && (last || copied == amount)) {
+         // one datagram per call, what did not fit is dropped
+         while (!last && *p && (*p)->id == id) {
+            last = (*p)->last;
+            _unlink(p);
+         }
+         break;
       }
    }
-   return 0;
+   return copied;
 }
 
 int32_t WNCATParser::_enqueue(int id, char *data, uint32_t amount) {
-   struct packet *packet = (struct packet *) malloc(sizeof(struct packet) + amount);
-   if (!packet) {
-      return -1;
-   }
+   struct packet *head = 0, **tail = &head;
+   uint32_t remaining = amount;
+
+   // split the chunk into pool blocks, the list is only published when complete
+   while (remaining > 0) {
+      struct packet *packet = _packet_pool.alloc();
+      if (!packet) {
+         tr_error("Packet pool exhausted, dropping %u bytes id=%d\n", (unsigned int)amount, id);
+         while (head) {
+            struct packet *q = head;
+            head = head->next;
+            _packet_pool.free(q);
+         }
+         return -1;
+      }
 
-   packet->id = id;
-   packet->len = (uint32_t) amount;
-   packet->next = 0;
-
-   // string to binary
-   char tmp[3];
-   tmp[2] = 0;
-   char *packet_data = packet->data;
-   for(unsigned int n=0; n<amount*2; n+=2) {
-      tmp[0] = *data++;
-      tmp[1] = *data++;
-      *packet_data=(char)strtol(tmp,NULL,16);
-      //tr_debug("%s %02x\n",tmp, *packet_data);
-      packet_data++;
-   }
+      packet->id = id;
+      packet->len = remaining < sizeof(packet->data) ? remaining : sizeof(packet->data);
+      packet->last = packet->len == remaining;
+      packet->next = 0;
+
+      // string to binary
+      hextobin((uint8_t *) packet->data, data, packet->len);
+      data += 2 * packet->len;
+
+      // dump binary data
+      //CIODUMP((uint8_t *) packet->data, (size_t)packet->len);
 
-   // dump binary data
-   //CIODUMP((uint8_t *) packet->data, (size_t)amount);
+      tr_debug("Enqueue packet id=%d len=%u\n",packet->id, (unsigned int)packet->len);
 
-   tr_debug("Enqueue packet id=%d len=%u\n",packet->id, (unsigned int)packet->len);
+      remaining -= packet->len;
+      *tail = packet;
+      tail = &packet->next;
+   }
 
    // append to packet list
-   *_packets_end = packet;
-   _packets_end = &packet->next;
+   if (head) {
+      *_packets_end = head;
+      _packets_end = tail;
+      _sock[id].buffered += amount;
+      _recv_stats.bytes_queued += amount;
+   }
 
    return amount;
 }
 
+WncPoolStats WNCATParser::packet_pool_stats() {
+   return _packet_pool.stats();
+}
+
+WncRecvStats WNCATParser::recv_stats() {
+   ChannelLock cache(_cache_mutex);
+   return _recv_stats;
+}
+
 int32_t WNCATParser::recv(int id, void *data, uint32_t amount) {
-   char recvBuffer[RXTX_BUFFER_SIZE];
-   int32_t ret = 0;
-    Timer timer;
-    timer.start();
+    return recv_any(&id, 1, data, amount, NULL);
+}
 
-    tr_debug("recv(id=%d, amount=%u)\n",id, (unsigned int)amount);
-    while (timer.read_ms() < _timeout) {
-        CSTDEBUG("WNC [%02d] !! _timeout=%d, time=%d\r\n", id, (int) _timeout, (int) timer.read() * 1000);
+int32_t WNCATParser::recv_any(const int *ids, int count, void *data, uint32_t amount, int *from) {
+    ChannelLock lock(_smutex);
 
-        //ret = _check_queue(id, recvBuffer, amount);
-        ret = _check_queue(id, data, amount);
-        if (ret) {
-           CIODUMP((uint8_t *) data, (size_t)ret);
-           return ret;
-        }
-
-        tr_debug("RECV:  Waiting . . .\n");
-        int id, session_indicator;
-        uint32_t amount;
-        uint32_t actual_length;
-        if (scan("@SOCKDATAIND: %d,%d,%d", &id, &session_indicator, &amount) == 3) {
-            tr_debug("@SOCKDATAIND id=%d, session_indicator=%d, amount=%u\n",id,session_indicator,(unsigned int)amount);
-            // more data
-            if(amount) {
-               tx("AT@SOCKREAD=%d,%d",id, MAX_SEND_BYTES);
-            }
-            // no more data
-            else {
-               tr_debug("RECV:  no more data indicated id=%d\n",id);
-               return -1;
+    tr_debug("recv(id=%d, count=%d, amount=%u)\n", count ? ids[0] : -1, count, (unsigned int)amount);
+    for (int i = 0; i < count; i++) {
+        if (ids[i] < 0 || ids[i] >= WNC_SOCKET_COUNT) {
+            return -1;
+        }
+    }
+
+    // pick up indications already sitting in the uart, never wait for new ones
+    while (_serial.readable()) {
+        _poll_urc(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        int id = ids[i];
+
+        // data read ahead by process(), or what the modem already reported
+        int32_t ret = _check_queue(id, data, amount);
+        if (!ret && _sock[id].pending) {
+            uint32_t want = _read_size(id);
+            if (want && want <= amount && !_sock[id].buffered) {
+                // the whole chunk fits, decode it straight into the caller's buffer
+                ret = _sockread(id, want);
+                if (ret > 0) {
+                    hextobin((uint8_t *) data, _rxhex, ret);
+                    _recv_stats.bytes_direct += ret;
+                } else {
+                    ret = 0;
+                }
+            } else if (_read_ahead(id) > 0) {
+                ret = _check_queue(id, data, amount);
             }
         }
-        if (scan("@SOCKREAD: %d,\"%s\"", &actual_length, recvBuffer) == 2) {
-            //tr_debug("Got data len=%u data=%s\n", (unsigned int)actual_length, recvBuffer);
-            rx("OK");
-            _enqueue(id, recvBuffer, actual_length);
+        if (ret) {
+            CIODUMP((uint8_t *) data, (size_t)ret);
+            if (from) *from = id;
+            return ret;
+        }
+    }
+
+    // only report the close once everything before it has been read
+    for (int i = 0; i < count; i++) {
+        if (_sock[ids[i]].closed && !_sock[ids[i]].pending) {
+            tr_debug("RECV:  no more data indicated id=%d\n", ids[i]);
+            if (from) *from = ids[i];
+            return 0;
         }
     }
 
-    // timeout
     return -1;
 }
 
+uint32_t WNCATParser::_read_size(int id) {
+    uint32_t window = MBED_CONF_APP_WNC_READAHEAD_WINDOW;
+    if (_sock[id].buffered >= window) {
+        return 0;
+    }
+
+    // exactly what the modem holds, bounded by local space
+    uint32_t size = _sock[id].pending;
+    if (size > window - _sock[id].buffered) {
+        size = window - _sock[id].buffered;
+    }
+
+    // on a weak link keep replies short so a lost line costs less
+    uint32_t limit = MAX_READ_BYTES;
+    if (_signal.rssi != 99 && _signal.rssi < 6) {
+        limit = 128;
+    } else if (_signal.rssi != 99 && _signal.rssi < 12) {
+        limit = 256;
+    }
+
+    return size < limit ? size : limit;
+}
+
+int32_t WNCATParser::_sockread(int id, uint32_t want) {
+    int actual_length = 0;
+    if (!(tx("AT@SOCKREAD=%d,%d", id, (int)want)
+          && scan("@SOCKREAD: %d,\"%s\"", &actual_length, _rxhex) == 2
+          && rx("OK"))) {
+        tr_error("SOCKREAD failed id=%d\n", id);
+        return -1;
+    }
+    //tr_debug("Got data len=%d data=%s\n", actual_length, _rxhex);
+
+    if (actual_length <= 0) {
+        // the modem has less than it reported, wait for the next indication
+        _sock[id].pending = 0;
+        return 0;
+    }
+
+    if ((uint32_t)actual_length >= _sock[id].pending) {
+        _sock[id].pending = 0;
+    } else {
+        _sock[id].pending -= actual_length;
+    }
+    return actual_length;
+}
+
+uint32_t WNCATParser::_queue_room() {
+    return _packet_pool.available() * MBED_CONF_APP_WNC_PACKET_BLOCK_SIZE;
+}
+
+int32_t WNCATParser::_read_ahead(int id) {
+    // what SOCKREAD takes is gone from the modem, never read more than the pool holds
+    uint32_t want = _read_size(id);
+    uint32_t room = _queue_room();
+    if (want > room) {
+        want = room;
+    }
+    if (!want) {
+        // the read resumes once the application drains the queue
+        return 0;
+    }
+
+    int32_t actual_length = _sockread(id, want);
+    if (actual_length <= 0) {
+        return actual_length;
+    }
+
+    if (_enqueue(id, _rxhex, actual_length) < 0) {
+        return 0;
+    }
+
+    if (_socket_event) {
+        _socket_event(id);
+    }
+    return actual_length;
+}
+
+void WNCATParser::_purge(int id) {
+    for (struct packet **p = &_packets; *p; ) {
+        if ((*p)->id != id) {
+            p = &(*p)->next;
+            continue;
+        }
+
+        _unlink(p);
+    }
+    memset(&_sock[id], 0, sizeof(_sock[id]));
+}
+
+bool WNCATParser::_poll_urc(uint32_t timeout) {
+    if (!_readline(_line, RXTX_BUFFER_SIZE - 1, timeout)) {
+        return false;
+    }
+
+    if (checkURC(_line) == -1) {
+        tr_debug("GSM -> '%s' (ignored)\n", _line);
+        return false;
+    }
+    return true;
+}
+
+void WNCATParser::process() {
+    if (!_smutex.trylock()) {
+        return;
+    }
+
+    // consume notifications that arrived while nobody was talking to the modem
+    while (_serial.readable()) {
+        _poll_urc(1);
+    }
+
+    // keep reading while the modem holds reported data and there is room
+    for (int id = 0; id < WNC_SOCKET_COUNT; id++) {
+        while (_sock[id].pending && _read_ahead(id) > 0) {
+        }
+    }
+
+    _smutex.unlock();
+}
+
+void WNCATParser::lock() {
+    _smutex.lock();
+}
+
+bool WNCATParser::trylock() {
+    return _smutex.trylock();
+}
+
+void WNCATParser::unlock() {
+    _smutex.unlock();
+}
+
+void WNCATParser::attach_socket_event(Callback<void(int)> func) {
+    _socket_event = func;
+}
+
+void WNCATParser::attach_activity(Callback<void()> func) {
+    _activity = func;
+}
+
+bool WNCATParser::idle() {
+    ChannelLock lock(_smutex);
+    if (_serial.readable()) {
+        return false;
+    }
+    for (int id = 0; id < WNC_SOCKET_COUNT; id++) {
+        if (_sock[id].pending && _read_size(id) && _queue_room()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool WNCATParser::close(int id) {
+    ChannelLock lock(_smutex);
     tr_debug("close(id=%d)\n",id);
-    if (tx("AT@SOCKCLOSE=%d",id) && rx("OK"))
-       return true;
+    bool closed = tx("AT@SOCKCLOSE=%d",id) && rx("OK");
 
-    return false;
+    // unread data of a closed socket would otherwise hold pool blocks
+    _purge(id);
+    return closed;
+}
+
+uint32_t WNCATParser::link_generation() {
+    return _link_generation;
+}
+
+bool WNCATParser::is_closed(int id) {
+    if (id < 0 || id >= WNC_SOCKET_COUNT) {
+        return true;
+    }
+    return _sock[id].closed;
 }
 
 void WNCATParser::setTimeout(uint32_t timeout_ms) {
@@ -754,40 +1474,73 @@ void WNCATParser::attach(Callback<void()> func) {
 }
 
 bool WNCATParser::tx(const char *pattern, ...) {
-    char cmd[RXTX_BUFFER_SIZE];
+    if (_activity) {
+        _activity();
+    }
 
-    while (flushRx(cmd, sizeof(cmd), 10)) {
-        CIODEBUG("GSM (%02d) !! '%s'\r\n", strlen(cmd), cmd);
-        checkURC(cmd);
+    while (flushRx(_cmd, sizeof(_cmd), 10)) {
+        CIODEBUG("GSM (%02d) !! '%s'\r\n", strlen(_cmd), _cmd);
+        checkURC(_cmd);
     }
 
     // cleanup the input buffer and check for URC messages
-    cmd[0] = '\0';
+    _cmd[0] = '\0';
 
     va_list ap;
     va_start(ap, pattern);
-    vsnprintf(cmd, RXTX_BUFFER_SIZE, pattern, ap);
+    vsnprintf(_cmd, RXTX_BUFFER_SIZE, pattern, ap);
     va_end(ap);
 
-    _serial.puts(cmd);
+    _serial.puts(_cmd);
     _serial.puts("\r\n");
-    CIODEBUG("GSM (%02d) <- '%s'\r\n", strlen(cmd), cmd);
+    CIODEBUG("GSM (%02d) <- '%s'\r\n", strlen(_cmd), _cmd);
+
+    return true;
+}
+
+bool WNCATParser::txsimple(const char *pattern, ...) {
+    if (_activity) {
+        _activity();
+    }
+
+    // cleanup the input buffer and check for URC messages
+    while (flushRx(_cmd, sizeof(_cmd), 10)) {
+        CIODEBUG("GSM (%02d) !! '%s'\r\n", strlen(_cmd), _cmd);
+        checkURC(_cmd);
+    }
+
+    va_list ap;
+    va_start(ap, pattern);
+    int len = vsnprintf(_cmd, RXTX_BUFFER_SIZE, pattern, ap);
+    va_end(ap);
+
+    if (len <= 0) {
+        return false;
+    }
+    if (len >= RXTX_BUFFER_SIZE) {
+        len = RXTX_BUFFER_SIZE - 1;
+    }
+
+    _serial.write(_cmd, len);
+    CIODEBUG("GSM (%02d) <- '%s'\r\n", len, _cmd);
 
     return true;
 }
 
 // readline ensuring the reader doesn't get notifications
 size_t WNCATParser::readline(char *buffer, size_t max, uint32_t timeout) {
-    char response[RXTX_BUFFER_SIZE];
-
     //TODO use if (readable()) here
     do {
-        _readline(response, RXTX_BUFFER_SIZE - 1, timeout);
-    } while (checkURC(response) != -1);
+        _readline(_line, RXTX_BUFFER_SIZE - 1, timeout);
+    } while (checkURC(_line) != -1);
    
-    CIODEBUG("GSM (%02d) -> '%s'\r\n", strlen(response), response);
+    CIODEBUG("GSM (%02d) -> '%s'\r\n", strlen(_line), _line);
 
-    strncpy(buffer, response, max);
+    if (!max) {
+        return 0;
+    }
+    strncpy(buffer, _line, max - 1);
+    buffer[max - 1] = '\0';
 
     return strlen(buffer);
 }
@@ -797,25 +1550,23 @@ int WNCATParser::scan(const char *pattern, ...) {
     timer.start();
     uint32_t timeout = 10;
 
-    char response[RXTX_BUFFER_SIZE];
-
     //TODO use if (readable()) here
     do {
-        _readline(response, RXTX_BUFFER_SIZE - 1, 10);
+        _readline(_line, RXTX_BUFFER_SIZE - 1, 10);
 
         if (timer.read() > timeout) {
            tr_error("scan() timeout\n");
            return -1;
         }
 
-    } while (checkURC(response) != -1);
+    } while (checkURC(_line) != -1);
 
     va_list ap;
     va_start(ap, pattern);
-    int matched = vsscanf(response, pattern, ap);
+    int matched = vsscanf(_line, pattern, ap);
     va_end(ap);
 
-    CIODEBUG("GSM (%02d) -> '%s' (%d)\r\n", strlen(response), response, matched);
+    CIODEBUG("GSM (%02d) -> '%s' (%d)\r\n", strlen(_line), _line, matched);
     return matched;
 }
 
@@ -823,25 +1574,70 @@ bool WNCATParser::rx(const char *pattern, uint32_t timeout) {
     Timer timer;
     timer.start();
 
-    char response[RXTX_BUFFER_SIZE];
-    size_t length = 0, patternLength = strnlen(pattern, sizeof(response));
+    size_t length = 0, patternLength = strnlen(pattern, sizeof(_line));
     do {
-        length = _readline(response, RXTX_BUFFER_SIZE - 1, timeout);
+        length = _readline(_line, RXTX_BUFFER_SIZE - 1, timeout);
         if (!length) return false;
         if (timer.read() > timeout) {
            tr_error("rx() timeout\n");
            return false;
         }
 
-        CIODEBUG("GSM (%02d) -> '%s'\r\n", strlen(response), response);
-    } while (checkURC(response) != -1);
+        CIODEBUG("GSM (%02d) -> '%s'\r\n", strlen(_line), _line);
+    } while (checkURC(_line) != -1);
 
-    return strncmp(pattern, (const char *) response, MIN(length, patternLength)) == 0;
+    return strncmp(pattern, (const char *) _line, MIN(length, patternLength)) == 0;
 }
 
 int WNCATParser::checkURC(const char *response) {
+    if (!strncmp("@SOCKDATAIND:", response, 13)) {
+        int id, session_indicator, amount;
+        if (sscanf(response, "@SOCKDATAIND: %d,%d,%d", &id, &session_indicator, &amount) == 3
+            && id >= 0 && id < WNC_SOCKET_COUNT) {
+            tr_debug("@SOCKDATAIND id=%d, session_indicator=%d, amount=%d\n",id,session_indicator,amount);
+            if (amount) {
+                // amount is what the modem holds in total, not what is new
+                _sock[id].pending = amount;
+            } else {
+                _sock[id].pending = 0;
+                _sock[id].closed = true;
+                if (_socket_event) {
+                    _socket_event(id);
+                }
+            }
+        }
+        return 0;
+    }
+    if (!strncmp("@SOCKCLOSE:", response, 11)) {
+        int id;
+        if (sscanf(response, "@SOCKCLOSE:%d", &id) == 1 && id >= 0 && id < WNC_SOCKET_COUNT) {
+            tr_debug("@SOCKCLOSE id=%d\n", id);
+            _sock[id].closed = true;
+            if (_socket_event) {
+                _socket_event(id);
+            }
+        }
+        return 0;
+    }
+    if (!strncmp("+CREG:", response, 6)) {
+        _update_reg(&_reg.creg, response + 6);
+        return 0;
+    }
+    if (!strncmp("+CEREG:", response, 7)) {
+        _update_reg(&_reg.cereg, response + 7);
+        return 0;
+    }
+    if (!strncmp("+CTZV:", response, 6) || !strncmp("+CTZE:", response, 6)) {
+        // the modem clock moved with the zone, pick it up on the next sync
+        tr_debug("GSM -> %s\n", response);
+        _time.zone_changes++;
+        _time_stale = true;
+        _time_attempt_ms = 0;
+        return 0;
+    }
     if (!strncmp("%NOTIFY", response, 7)) {
         tr_debug("GSM -> %s\n", response);
+        _ip_valid = false;
         return 0;
     }
     if (!strncmp("SMS Ready", response, 9)
@@ -849,10 +1645,15 @@ int WNCATParser::checkURC(const char *response) {
         || !strncmp("+CPIN: READY", response, 12)
         || !strncmp("+QNTP: 0", response, 8)
         || !strncmp("+QNTP: 5", response, 8)
-        || !strncmp("+PDP DEACT", response, 10)
         ) {
         return 0;
     }
+    if (!strncmp("+PDP DEACT", response, 10)) {
+        tr_debug("GSM -> %s\n", response);
+        _link_generation++;
+        _ip_valid = false;
+        return 0;
+    }
 
     // did not consume the response
     return -1;
@@ -907,6 +1708,33 @@ size_t WNCATParser::_readline(char *buffer, size_t max, uint32_t timeout) {
     return idx;
 }
 
+size_t WNCATParser::_readline_ms(char *buffer, size_t max, uint32_t timeout_ms) {
+    Timer timer;
+    timer.start();
+
+    size_t idx = 0;
+
+    while (idx < max && (uint32_t)timer.read_ms() < timeout_ms) {
+        if (!_serial.readable()) {
+            Thread::wait(1);
+            continue;
+        }
+
+        int c = _serial.getc();
+
+        if (c == '\r') continue;
+
+        if (c == '\n') {
+            if (!idx) continue;
+            break;
+        }
+        if (isprint(c)) buffer[idx++] = (char) c;
+    }
+
+    buffer[idx] = 0;
+    return idx;
+}
+
 size_t WNCATParser::flushRx(char *buffer, size_t max, uint32_t timeout) {
     Timer timer;
     timer.start();
@@ -31,11 +31,48 @@
 #include <stdint.h>
 #include <features/netsocket/nsapi_types.h>
 #include <BufferedSerial/BufferedSerial.h>
+#include "WNCPool.h"
 
 #define WNC_SOCKET_COUNT 5
 #define WNC_TCP 1
 #define WNC_UDP 2
 
+#define RXTX_BUFFER_SIZE   1500
+#define MAX_SEND_BYTES     1400
+#define WNC_SEND_RETRIES   3
+// an @SOCKREAD reply carries two hex digits per byte and must fit in one line
+#define MAX_READ_BYTES     ((RXTX_BUFFER_SIZE - 32) / 2)
+
+// settle time after the reset lines and level translator are set, in ms
+#define WNC_RESET_SETTLE   100
+
+// AT probes while the modem boots, in ms: first gap, largest gap, give up
+#define WNC_PROBE_MIN      50
+#define WNC_PROBE_MAX      500
+#define WNC_BOOT_TIMEOUT   30000
+
+// how long connect waits for a registration URC, in ms
+#define WNC_REG_TIMEOUT    15000
+
+// Received packets are kept in fixed size blocks from a static pool, sized so every
+// socket can fill its read-ahead window: 4 sockets x 1400 bytes in 256 byte blocks
+#ifndef MBED_CONF_APP_WNC_PACKET_POOL_COUNT
+#  define MBED_CONF_APP_WNC_PACKET_POOL_COUNT 24
+#endif
+#ifndef MBED_CONF_APP_WNC_PACKET_BLOCK_SIZE
+#  define MBED_CONF_APP_WNC_PACKET_BLOCK_SIZE 256
+#endif
+
+// When set, the driver only uses static storage (no new/malloc/std::string)
+#ifndef MBED_CONF_APP_WNC_ZERO_HEAP
+#  define MBED_CONF_APP_WNC_ZERO_HEAP 0
+#endif
+
+// Bytes per socket the driver reads ahead of the application after @SOCKDATAIND
+#ifndef MBED_CONF_APP_WNC_READAHEAD_WINDOW
+#  define MBED_CONF_APP_WNC_READAHEAD_WINDOW 1400
+#endif
+
 struct WncIpStats
 {
     int  cid;			      //
@@ -47,6 +84,108 @@ struct WncIpStats
     char dnsSecondary[16];
 };
 
+/** One buffer of a WNCATParser::sendv() call */
+struct WncSegment
+{
+    const void *data;
+    uint32_t size;
+    uint32_t sent;          // bytes the modem acknowledged, filled in by sendv()
+};
+
+/** Time spent in each phase of the last startup() or reset(), in ms */
+struct WncBootStats
+{
+    uint32_t reset_ms;      // reset lines and level translator, including WNC_RESET_SETTLE
+    uint32_t ready_ms;      // until the modem answered an AT probe
+    uint32_t configure_ms;  // echo, error format and message mode setup
+    uint32_t probes;        // AT probes sent until the answer
+    bool boot_urc;          // the modem announced itself before answering
+};
+
+/** Network registration as last reported by +CREG/+CEREG */
+struct WncRegStatus
+{
+    int creg;               // +CREG <stat>, -1 until reported
+    int cereg;              // +CEREG <stat>, -1 until reported
+    uint32_t area;          // location or tracking area code of the serving cell
+    uint32_t cell;          // cell id of the serving cell
+    int act;                // access technology, -1 if not reported
+    uint32_t changes;       // reports that changed the state
+};
+
+// Features a firmware release is known to support, see WncIdentity
+#define WNC_FEATURE_CESQ    0x01    // AT+CESQ extended signal quality
+#define WNC_FEATURE_NITZ    0x02    // network time from +CTZV/+CTZE
+#define WNC_FEATURE_PSM     0x04    // AT+CPSMS power saving mode
+#define WNC_FEATURE_EDRX    0x08    // AT+CEDRXS extended DRX
+
+// First firmware release (major * 100 + minor) carrying each feature, 0 keeps it off
+// until the release is confirmed for the modules in use
+#ifndef MBED_CONF_APP_WNC_FW_CESQ
+#  define MBED_CONF_APP_WNC_FW_CESQ 0
+#endif
+#ifndef MBED_CONF_APP_WNC_FW_NITZ
+#  define MBED_CONF_APP_WNC_FW_NITZ 0
+#endif
+#ifndef MBED_CONF_APP_WNC_FW_PSM
+#  define MBED_CONF_APP_WNC_FW_PSM 0
+#endif
+#ifndef MBED_CONF_APP_WNC_FW_EDRX
+#  define MBED_CONF_APP_WNC_FW_EDRX 0
+#endif
+#define WNC_FW_CESQ         MBED_CONF_APP_WNC_FW_CESQ
+#define WNC_FW_NITZ         MBED_CONF_APP_WNC_FW_NITZ
+#define WNC_FW_PSM          MBED_CONF_APP_WNC_FW_PSM
+#define WNC_FW_EDRX         MBED_CONF_APP_WNC_FW_EDRX
+
+/** Module identity, read once per power cycle */
+struct WncIdentity
+{
+    char imei[16];          // AT+GSN, empty until read
+    char iccid[21];         // AT%CCID, empty until read (needs a SIM)
+    char firmware[64];      // first line of AT+GMR, empty until read
+    int fw_version;         // major * 100 + minor of the firmware, 0 if unknown
+    uint32_t features;      // WNC_FEATURE_* bits derived from fw_version
+};
+
+// dBm reported for a signal level the modem does not know
+#define WNC_DBM_UNKNOWN -199
+
+/** Signal quality and battery as last sampled, timestamps in ms since start */
+struct WncSignalStatus
+{
+    int rssi;               // +CSQ <rssi>, 99 if unknown
+    int ber;                // +CSQ <ber>, 99 if unknown
+    int dbm;                // rssi in dBm, WNC_DBM_UNKNOWN if unknown
+    int rsrp;               // +CESQ RSRP in dBm, WNC_DBM_UNKNOWN if unknown
+    int rsrq;               // +CESQ RSRQ in dB, WNC_DBM_UNKNOWN if unknown
+    uint32_t signal_ms;     // when rssi..rsrq were read, 0 if never
+    int bat_status;         // +CBC <bcs>
+    int bat_level;          // +CBC <bcl>, percent
+    int bat_voltage;        // +CBC voltage in mV
+    uint32_t battery_ms;    // when the battery was read, 0 if never
+};
+
+// Time in ms before a failed network time sync is tried again
+#define WNC_CLOCK_RETRY 60000
+
+/** State of the MCU RTC as set from network time */
+struct WncClockStatus
+{
+    bool synced;            // the RTC holds network time
+    int zone;               // local time offset in quarter hours, as reported by +CCLK
+    uint32_t synced_ms;     // when the RTC was last set, ms since start
+    uint32_t syncs;         // times the RTC was set
+    uint32_t zone_changes;  // +CTZV/+CTZE reports received
+};
+
+/** Where received bytes went on their way to the application */
+struct WncRecvStats
+{
+    uint32_t bytes_direct;  // decoded straight into the caller's buffer
+    uint32_t bytes_queued;  // decoded into the packet queue and copied later
+};
+
 /** WNC AT Parser Interface class.
     This is an interface to a WNC modem.
  */
@@ -120,38 +259,75 @@ public:
     bool requestDateTime(void);
 
     /**
-    * Connect WNC to the network
+    * Wait for the WNC to register with the mobile network
+    *
+    * @param timeout_ms how long to wait for a registration URC
+    * @return true once registered home or roaming
+    */
+    bool registerNetwork(uint32_t timeout_ms);
+
+    /**
+    * Set the APN and bring up the internet PDN context
+    * The replies do not tell whether it worked, use probeLink() for that.
     *
     * @param apn the address of the network APN
     * @param userName the user name
     * @param passPhrase the password
-    * @return true only if WNC is connected successfully
     */
-    bool connect(const char *apn, const char *userName, const char *passPhrase);
+    void activatePDN(const char *apn, const char *userName, const char *passPhrase);
 
     /**
      * Get the IP address of WNC
+     * Served from memory while the context is known to be up, the modem is
+     * only asked after +PDP DEACT, %NOTIFY, lost registration or a socket error.
      *
      * @return null-teriminated IP address or null if no IP address is assigned
      */
     const char *getIPAddress(void);
 
+    /**
+     * Get the PDN context details of the last +CGCONTRDP
+     *
+     * @param stats destination for the context details
+     * @return true if the cached context is still valid
+     */
+    bool ip_stats(WncIpStats *stats);
+
     /**
      * Get the IMEI of WNC
+     * Read from the modem once per power cycle, from memory afterwards.
      *
-     * @return null-teriminated value or null if value is assigned
+     * @param getimei buffer of at least 16 bytes for the null-terminated value
+     * @return true if the IMEI is known
      */
     bool getIMEI(char *getimei);
 
     /**
-     * Get the ICCID of WNC
+     * Get the ICCID of the SIM
+     * Read from the modem once per power cycle, from memory afterwards.
      *
-     * @return null-teriminated value or null if value is assigned
+     * @param geticcid buffer of at least 21 bytes for the null-terminated value
+     * @return true if the ICCID is known
      */
     bool getICCID(char *geticcid);
 
+    /**
+     * Get the module identity read since the last hard reset
+     */
+    WncIdentity identity();
+
+    /**
+     * Check whether the running firmware is known to support a feature
+     *
+     * @param feature one of the WNC_FEATURE_* bits
+     * @return true if supported, false if not or the firmware is unknown
+     */
+    bool hasFeature(uint32_t feature);
+
     /**
      * Get the Latitude, Longitude, Date and Time of the device
+     * The date and time come from the RTC, the modem is only asked for them
+     * if the RTC was never synced.
      *
      * @param lat latitude
      * @param lon longitude
@@ -160,6 +336,59 @@ public:
      */
     bool getLocation(char *lon, char *lat, tm *datetime, int *zone = 0);
 
+    /**
+     * Set the RTC from the network time the modem holds (+CCLK)
+     *
+     * @return true if the modem had network time
+     */
+    bool syncClock(void);
+
+    /**
+     * Check whether the RTC should be synced again
+     *
+     * @param max_age_ms age after which a synced RTC is re-synced
+     * @return true if never synced, the time zone changed or the sync is older than max_age_ms
+     */
+    bool clockDue(uint32_t max_age_ms);
+
+    /**
+     * Get the local date and time from the RTC, no AT traffic
+     *
+     * @param datetime local date and time, tm_year from 1900 and tm_mon from 0
+     * @param zone local time offset in quarter hours, may be null
+     * @return false if the RTC was never synced
+     */
+    bool getDateTime(tm *datetime, int *zone = 0);
+
+    /**
+     * Get the state of the RTC sync
+     */
+    WncClockStatus clock_status();
+
+    /**
+     * Request PSM timers with AT+CPSMS
+     *
+     * @param tau 8 bit T3412 extended timer, null turns PSM off
+     * @param active 8 bit T3324 timer
+     * @return true if the modem accepted the request
+     */
+    bool setPSM(const char *tau, const char *active);
+
+    /**
+     * Request an E-UTRAN eDRX cycle with AT+CEDRXS
+     *
+     * @param cycle 4 bit eDRX cycle value, null turns eDRX off
+     * @return true if the modem accepted the request
+     */
+    bool setEDRX(const char *cycle);
+
+    /**
+     * Drive the wakeup line of the modem
+     *
+     * @param awake false lets the modem sleep between transmissions
+     */
+    void setWakeup(bool awake);
+
 
     /**
      * Get the Battery status, level and voltage of the device
@@ -171,6 +400,25 @@ public:
      */
     bool modem_battery(uint8_t *status, int *level, int *voltage);
 
+    /**
+     * Read +CSQ, and +CESQ where the firmware has it, into the signal status
+     *
+     * @return true if +CSQ answered
+     */
+    bool sampleSignal(void);
+
+    /**
+     * Read +CBC into the signal status
+     *
+     * @return true if +CBC answered
+     */
+    bool sampleBattery(void);
+
+    /**
+     * Get the signal quality and battery as last sampled, without talking to the modem
+     */
+    WncSignalStatus signal_status();
+
     /**
     * Check if WNC is connected
     *
@@ -178,6 +426,34 @@ public:
     */
     bool isConnected(void);
 
+    /**
+    * Check whether a modem started earlier is still usable as it is
+    * Probes AT, +CGATT? and +CGCONTRDP, never resets anything.
+    *
+    * @return true if the modem answers, is attached and its PDN context has an address
+    */
+    bool probeLink(void);
+
+    /**
+    * Check whether startup() configured the modem since power up
+    */
+    bool isInitialized(void);
+
+    /**
+    * Check the registration state last reported by +CREG/+CEREG
+    *
+    * @return true if registered home or roaming
+    */
+    bool isRegistered(void);
+
+    /**
+    * Turn the radio off and on again with AT+CFUN, keeping the modem configuration
+    * The PDN context is lost, registration starts over.
+    *
+    * @return true if the modem accepted both commands
+    */
+    bool cycleRadio(void);
+
     /**
     * Get the IP of the host
     *
@@ -201,14 +477,28 @@ public:
 
     /**
     * Sends data to an open socket
-    * 1046 Bytes can be sent each time
+    * Data is written in chunks of MAX_SEND_BYTES, the next chunk is
+    * hex encoded while the previous one is transmitted.
     *
     * @param id id of socket to send to
     * @param data data to be sent
-    * @param amount amount of data to be sent - max 1024
-    * @return true only if data sent successfully
+    * @param amount amount of data to be sent
+    * @return the number of bytes the modem acknowledged, -1 if none
+    */
+    int32_t send(int id, const void *data, uint32_t amount);
+
+    /**
+    * Sends several buffers to an open socket back to back
+    * Every segment is written with its own SOCKWRITE sequence, so on a UDP
+    * socket each one is a datagram. Encoding of the next segment overlaps
+    * the transmission of the previous one.
+    *
+    * @param id id of socket to send to
+    * @param segs buffers to send, their sent field is filled in
+    * @param count number of buffers
+    * @return number of leading segments sent completely, sending stops at the first failure
     */
-    bool send(int id, const void *data, uint32_t amount);
+    int sendv(int id, WncSegment *segs, int count);
 
     /**
     * Get the WNC connection status
@@ -218,15 +508,27 @@ public:
     int queryConnection();
 
     /**
-    * Receives data from an open socket
+    * Receives data from an open socket without waiting
     *
     * @param id id to receive from
     * @param data placeholder for returned information
     * @param amount number of bytes to be received
-    * @return the number of bytes received
+    * @return the number of bytes received, 0 if the remote side closed, -1 if nothing is available
     */
     int32_t recv(int id, void *data, uint32_t amount);
 
+    /**
+    * Receives data from whichever of several open sockets has some, without waiting
+    *
+    * @param ids ids to receive from
+    * @param count number of ids
+    * @param data placeholder for returned information
+    * @param amount number of bytes to be received
+    * @param from if not null, set to the id the data or close came from
+    * @return the number of bytes received, 0 if the remote side closed, -1 if nothing is available
+    */
+    int32_t recv_any(const int *ids, int count, void *data, uint32_t amount, int *from);
+
     /**
     * Closes a socket
     *
@@ -235,6 +537,25 @@ public:
     */
     bool close(int id);
 
+    /**
+    * Check whether the remote side closed a socket
+    * Set by @SOCKCLOSE or an @SOCKDATAIND with no data, cleared when the
+    * id is opened again.
+    *
+    * @param id id of the socket
+    * @return true if the connection is known to be gone
+    */
+    bool is_closed(int id);
+
+    /**
+    * Get a counter that changes whenever the data connection may have
+    * been lost (modem restart or +PDP DEACT), for invalidating state
+    * learned over it
+    *
+    * @return the current link generation
+    */
+    uint32_t link_generation();
+
     /**
     * Allows timeout to be changed between commands
     *
@@ -302,7 +623,7 @@ public:
     /*!
     * @brief Read a single line from the WNC
     * @param buffer the character line buffer to read into
-    * @param max the number of characters to read
+    * @param max the size of buffer, the line is cut to max - 1 characters and terminated
     * @return the number of characters read
     */
     size_t readline(char *buffer, size_t max, uint32_t timeout);
@@ -317,6 +638,63 @@ public:
 
     size_t flushRx(char *buffer, size_t max, uint32_t timeout = 5);
 
+    /**
+    * Get the usage statistics of the received packet pool
+    */
+    WncPoolStats packet_pool_stats();
+
+    /**
+    * Get the direct and queued receive byte counters
+    */
+    WncRecvStats recv_stats();
+
+    /**
+    * Get the phase timings of the last startup or reset
+    */
+    WncBootStats boot_stats();
+
+    /**
+    * Get the registration state and serving cell, kept up to date from URCs
+    */
+    WncRegStatus registration();
+
+    /**
+    * Attach a function to call when data has been buffered for a socket
+    * or the remote side closed it
+    *
+    * @param func called with the socket id, from the thread that read the data
+    */
+    void attach_socket_event(Callback<void(int)> func);
+
+    /**
+    * Attach a function to call before every AT command is written
+    *
+    * @param func called with the AT channel held, e.g. to wake the modem
+    */
+    void attach_activity(Callback<void()> func);
+
+    /**
+    * Check that the AT channel has nothing outstanding: no unread input
+    * and no socket data reported by the modem that would be read ahead
+    */
+    bool idle();
+
+    /**
+    * Service the modem while the AT channel is idle
+    *
+    * Consumes pending URCs and reads ahead into the socket buffers of any
+    * socket the modem reported data for. Returns at once if another thread
+    * holds the AT channel.
+    */
+    void process();
+
+    /**
+    * Take and release the AT channel for a sequence of commands
+    */
+    void lock();
+    bool trylock();
+    void unlock();
+
 private:
     BufferedSerial _serial;
 
@@ -327,25 +705,97 @@ private:
         struct packet *next;
         int id;
         uint32_t len;
-        char data[0];
-        // data follows
+        bool last;          // ends the SOCKREAD chunk, a whole datagram on UDP
+        char data[MBED_CONF_APP_WNC_PACKET_BLOCK_SIZE];
     } *_packets, **_packets_end;
 
+    WNCPool<struct packet, MBED_CONF_APP_WNC_PACKET_POOL_COUNT> _packet_pool;
+
+    // per socket receive state, driven by @SOCKDATAIND
+    struct sockstate {
+        uint32_t buffered;  // bytes decoded into the packet queue
+        uint32_t pending;   // bytes the modem reported and we have not read yet
+        bool closed;        // remote side closed, until the id is opened again
+        bool datagram;      // UDP, chunks are handed out one datagram per read
+    } _sock[WNC_SOCKET_COUNT];
+
+    WncSignalStatus _signal;
+    Timer _clock;           // timestamps of _signal and _time
+    WncClockStatus _time;
+    volatile bool _time_stale;  // a time zone URC arrived since the last sync
+    uint32_t _time_attempt_ms;  // last failed sync, 0 if none
+    volatile uint32_t _link_generation;
+    WncRecvStats _recv_stats;
+    WncBootStats _boot_stats;
+    WncRegStatus _reg;
+
+    Mutex _smutex;
+    // held only to update or copy the cached status structs, so their
+    // accessors never wait for an AT exchange; taken after _smutex, never before
+    Mutex _cache_mutex;
+    Callback<void(int)> _socket_event;
+    Callback<void()> _activity;
+    char _rxhex[RXTX_BUFFER_SIZE];
+    // command and reply lines, kept off the caller's stack and serialized by _smutex
+    char _cmd[RXTX_BUFFER_SIZE];
+    char _line[RXTX_BUFFER_SIZE];
+    char _txhex[2][2 * MAX_SEND_BYTES];
+
     void _packet_handler(const char *response);
 
+    // read one line and dispatch it if it is a URC
+    bool _poll_urc(uint32_t timeout);
+
+    // issue one @SOCKREAD, leaves the hex payload in _rxhex
+    int32_t _sockread(int id, uint32_t want);
+
+    // fetch data the modem reported for a socket into its packet queue
+    int32_t _read_ahead(int id);
+
+    // number of bytes the next @SOCKREAD for a socket should ask for
+    uint32_t _read_size(int id);
+
+    // drop everything queued for a socket
+    void _purge(int id);
+
     // interal readline
     size_t _readline(char *buffer, size_t max, uint32_t timeout);
 
+    // _readline() with a deadline in ms, for the boot probes
+    size_t _readline_ms(char *buffer, size_t max, uint32_t timeout_ms);
+
+    // probe with AT at growing intervals until the modem answers
+    bool _wait_ready(uint32_t timeout_ms);
+
+    // settings applied once the modem answers
+    bool _configure(void);
+
+    // update _reg from the arguments of a +CREG/+CEREG line
+    void _update_reg(int *stat, const char *args);
+    bool _registered(void);
+
+    // fill the parts of _identity not read since the last hard reset
+    void _read_identity(void);
+    bool _read_imei(void);
+
+    // read URCs until registered or the deadline passes
+    bool _wait_registered(uint32_t timeout_ms);
+
     int32_t _check_queue(int id, void *data, uint32_t amount);
+    uint32_t _queue_room();
+    void _unlink(struct packet **p);
     int32_t _enqueue(int id, char *data, uint32_t amount);
 
     void _debug_dump(const char *prefix, const uint8_t *b, size_t size);
 
+    // ask the modem for the PDN context and refresh the cached one
+    const char *_queryIPAddress(void);
+
     bool _initialized;
     int _timeout;
+    volatile bool _ip_valid;    // _ipstats/_ip_buffer match the modem
     char _ip_buffer[16];
-    char _imei[16];
-    char _iccid[20];
+    WncIdentity _identity;
     struct WncIpStats _ipstats;
 
 };
@@ -0,0 +1,122 @@
+/*!
+ * @file
+ * @brief Fixed-block pool allocator for WNC driver objects.
+ *
+ * Wraps an RTOS MemoryPool (statically allocated storage) and keeps
+ * usage statistics so the driver never needs the general heap for
+ * sockets or received packets.
+ *
+ * ```
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ```
+ */
+#ifndef WNCPOOL_H
+#define WNCPOOL_H
+
+#include "mbed.h"
+#include <new>
+
+/** Usage statistics of a WNCPool */
+struct WncPoolStats
+{
+    uint32_t capacity;      // number of blocks in the pool
+    uint32_t block_size;    // size of one block in bytes
+    uint32_t in_use;        // blocks currently handed out
+    uint32_t high_water;    // largest in_use seen since boot
+    uint32_t failures;      // allocations refused because the pool was empty
+};
+
+/** WNCPool class
+ *  Fixed number of fixed size blocks of type T, allocated from static storage.
+ *  alloc() and free() may be called from interrupt context.
+ */
+template <typename T, uint32_t N>
+class WNCPool {
+public:
+    WNCPool() {
+        memset(&_stats, 0, sizeof(_stats));
+        _stats.capacity = N;
+        _stats.block_size = sizeof(T);
+    }
+
+    /** Allocate a raw block
+     *  @return pointer to the block or NULL if the pool is exhausted
+     */
+    T *alloc() {
+        T *block = _pool.alloc();
+
+        core_util_critical_section_enter();
+        if (!block) {
+            _stats.failures++;
+        } else if (++_stats.in_use > _stats.high_water) {
+            _stats.high_water = _stats.in_use;
+        }
+        core_util_critical_section_exit();
+
+        return block;
+    }
+
+    /** Return a raw block to the pool
+     *  @param block block obtained from alloc(), NULL is ignored
+     */
+    void free(T *block) {
+        if (!block || _pool.free(block) != osOK) {
+            return;
+        }
+
+        core_util_critical_section_enter();
+        _stats.in_use--;
+        core_util_critical_section_exit();
+    }
+
+    /** Allocate a block and default construct a T in it
+     *  @return the new object or NULL if the pool is exhausted
+     */
+    T *construct() {
+        T *block = alloc();
+        return block ? new (block) T() : NULL;
+    }
+
+    /** Destroy an object created by construct() and release its block
+     *  @param obj object to destroy, NULL is ignored
+     */
+    void destroy(T *obj) {
+        if (!obj) {
+            return;
+        }
+        obj->~T();
+        free(obj);
+    }
+
+    /** Get the number of blocks that can still be allocated */
+    uint32_t available() {
+        core_util_critical_section_enter();
+        uint32_t left = N - _stats.in_use;
+        core_util_critical_section_exit();
+        return left;
+    }
+
+    /** Get a snapshot of the pool statistics */
+    WncPoolStats stats() {
+        core_util_critical_section_enter();
+        WncPoolStats snapshot = _stats;
+        core_util_critical_section_exit();
+        return snapshot;
+    }
+
+private:
+    MemoryPool<T, N> _pool;
+    WncPoolStats _stats;
+};
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * Heap trap for the zero-heap build of the WNC14A2A driver.
+ *
+ * ```
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ```
+ */
+
+#include "mbed.h"
+#include "WNCATParser.h"
+
+#if MBED_CONF_APP_WNC_ZERO_HEAP
+
+// Linked with profiles/wnc_zero_heap.json, which passes --wrap for each of
+// these symbols, every malloc() and new in the image lands here and stops
+// the board with the size that was asked for. Without the profile these
+// are never referenced.
+
+extern "C" {
+
+void *__wrap_malloc(size_t size)
+{
+    error("WNC zero-heap: malloc(%u)\r\n", (unsigned int)size);
+    return NULL;
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    error("WNC zero-heap: calloc(%u, %u)\r\n", (unsigned int)count, (unsigned int)size);
+    return NULL;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    error("WNC zero-heap: realloc(%p, %u)\r\n", ptr, (unsigned int)size);
+    return NULL;
+}
+
+// operator new(unsigned int) and operator new[](unsigned int)
+void *__wrap__Znwj(size_t size)
+{
+    error("WNC zero-heap: new(%u)\r\n", (unsigned int)size);
+    return NULL;
+}
+
+void *__wrap__Znaj(size_t size)
+{
+    error("WNC zero-heap: new[](%u)\r\n", (unsigned int)size);
+    return NULL;
+}
+
+}
+
+#endif
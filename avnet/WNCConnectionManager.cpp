@@ -0,0 +1,312 @@
+/*
+ * Persistent TCP sessions on top of the WNC14A2A interface.
+ *
+ * ```
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ```
+ */
+
+#include <string.h>
+#include "WNCConnectionManager.h"
+#include "mbed-trace/mbed_trace.h"
+
+#define TRACE_GROUP "wncCM"
+
+#define WNC_CM_TIMEOUT 15000
+
+WNCConnectionManager::WNCConnectionManager(WNC14A2AInterface &iface)
+    : _iface(iface), _readable(0), _timeout(WNC_CM_TIMEOUT),
+      _keepalive_size(0), _keepalive_interval(0), _keepalive_event(0)
+{
+    memset(_sessions, 0, sizeof(_sessions));
+    memset(&_stats, 0, sizeof(_stats));
+    _clock.start();
+}
+
+WNCConnectionManager::~WNCConnectionManager()
+{
+    set_keepalive(NULL, 0, 0);
+    close_all();
+}
+
+void WNCConnectionManager::sigio(void *data)
+{
+    WNCConnectionManager *cm = (WNCConnectionManager *)data;
+    cm->_readable.release();
+}
+
+WNCConnectionManager::session *WNCConnectionManager::find(const char *host, uint16_t port)
+{
+    for (int i = 0; i < MBED_CONF_APP_WNC_CM_SESSIONS; i++) {
+        if (_sessions[i].port == port && !strncmp(_sessions[i].host, host, sizeof(_sessions[i].host))) {
+            return &_sessions[i];
+        }
+    }
+    return NULL;
+}
+
+nsapi_error_t WNCConnectionManager::open(session *s)
+{
+    SocketAddress addr;
+    void *handle;
+
+    nsapi_error_t err = _iface.gethostbyname(s->host, &addr, NSAPI_UNSPEC);
+    if (err) {
+        return err;
+    }
+    addr.set_port(s->port);
+
+    err = _iface.socket_open(&handle, NSAPI_TCP);
+    if (err) {
+        return err;
+    }
+    _iface.socket_attach(handle, &WNCConnectionManager::sigio, this);
+
+    err = _iface.socket_connect(handle, addr);
+    if (err) {
+        _iface.socket_close(handle);
+        return err;
+    }
+
+    tr_debug("open(%s:%d)\n", s->host, s->port);
+    s->handle = handle;
+    s->last_used = _clock.read_ms();
+    return NSAPI_ERROR_OK;
+}
+
+void WNCConnectionManager::drop(session *s)
+{
+    if (s->handle) {
+        tr_debug("drop(%s:%d)\n", s->host, s->port);
+        _iface.socket_close(s->handle);
+        s->handle = NULL;
+    }
+}
+
+WNCConnectionManager::session *WNCConnectionManager::acquire(const char *host, uint16_t port)
+{
+    session *s = find(host, port);
+
+    if (s && s->handle) {
+        if (!_iface.socket_closed(s->handle)) {
+            _stats.hits++;
+            return s;
+        }
+
+        // remote side went away since the last cycle
+        _stats.reconnects++;
+        drop(s);
+    }
+
+    if (!s) {
+        // a free slot, or the least recently used session
+        s = &_sessions[0];
+        for (int i = 0; i < MBED_CONF_APP_WNC_CM_SESSIONS; i++) {
+            if (!_sessions[i].handle) {
+                s = &_sessions[i];
+                break;
+            }
+            if (_sessions[i].last_used < s->last_used) {
+                s = &_sessions[i];
+            }
+        }
+        drop(s);
+
+        strncpy(s->host, host, sizeof(s->host) - 1);
+        s->host[sizeof(s->host) - 1] = '\0';
+        s->port = port;
+    }
+
+    _stats.misses++;
+    return s;
+}
+
+nsapi_size_or_error_t WNCConnectionManager::transact(const char *host, uint16_t port,
+                                                     const void *request, unsigned req_size,
+                                                     void *response, unsigned resp_size)
+{
+    nsapi_size_or_error_t ret = NSAPI_ERROR_OK;
+
+    _mutex.lock();
+    session *s = acquire(host, port);
+
+    // anything still buffered belongs to an earlier cycle, e.g. a response
+    // that came in after its transact() timed out, and is thrown away
+    while (s->handle) {
+        ret = _iface.socket_recv(s->handle, response, resp_size);
+        if (ret > 0) {
+            continue;
+        }
+        if (ret != NSAPI_ERROR_WOULD_BLOCK) {
+            _stats.reconnects++;
+            drop(s);
+        }
+        break;
+    }
+
+    if (!s->handle) {
+        ret = open(s);
+        if (ret) {
+            _mutex.unlock();
+            return ret;
+        }
+    }
+
+    // a send failure on a reused session is taken as a stale connection
+    for (int attempt = 0; attempt < 2; attempt++) {
+        unsigned sent = 0;
+        while (sent < req_size) {
+            ret = _iface.socket_send(s->handle, (const char *)request + sent, req_size - sent);
+            if (ret <= 0) {
+                break;
+            }
+            sent += ret;
+        }
+        if (sent == req_size) {
+            break;
+        }
+
+        drop(s);
+        if (attempt) {
+            _mutex.unlock();
+            return ret < 0 ? ret : NSAPI_ERROR_CONNECTION_LOST;
+        }
+
+        _stats.reconnects++;
+        ret = open(s);
+        if (ret) {
+            _mutex.unlock();
+            return ret;
+        }
+    }
+
+    // the response may arrive in several reads, it is complete once the
+    // buffer is full or nothing more came for WNC_CM_RESPONSE_GAP ms
+    unsigned received = 0;
+    ret = 0;
+    Timer timer;
+    timer.start();
+    while (received < resp_size) {
+        ret = _iface.socket_recv(s->handle, (char *)response + received, resp_size - received);
+        if (ret > 0) {
+            received += ret;
+            timer.reset();
+            continue;
+        }
+
+        int limit = received ? WNC_CM_RESPONSE_GAP : _timeout;
+        if (ret == NSAPI_ERROR_WOULD_BLOCK && !_iface.socket_closed(s->handle)
+            && timer.read_ms() < limit) {
+            _readable.wait(limit - timer.read_ms());
+            continue;
+        }
+
+        if (ret == NSAPI_ERROR_WOULD_BLOCK && received) {
+            break;
+        }
+
+        // closed while we waited, or nothing came back: reconnect next time
+        drop(s);
+        if (!received && (ret == 0 || ret == NSAPI_ERROR_WOULD_BLOCK)) {
+            ret = NSAPI_ERROR_CONNECTION_LOST;
+        }
+        break;
+    }
+    if (received) {
+        ret = received;
+    }
+
+    s->last_used = _clock.read_ms();
+    _mutex.unlock();
+    return ret;
+}
+
+void WNCConnectionManager::close(const char *host, uint16_t port)
+{
+    _mutex.lock();
+    session *s = find(host, port);
+    if (s) {
+        drop(s);
+    }
+    _mutex.unlock();
+}
+
+void WNCConnectionManager::close_all()
+{
+    _mutex.lock();
+    for (int i = 0; i < MBED_CONF_APP_WNC_CM_SESSIONS; i++) {
+        drop(&_sessions[i]);
+    }
+    _mutex.unlock();
+}
+
+void WNCConnectionManager::set_timeout(int timeout_ms)
+{
+    _timeout = timeout_ms;
+}
+
+nsapi_error_t WNCConnectionManager::set_keepalive(const void *payload, unsigned size, int interval_ms)
+{
+    if (payload && (size > sizeof(_keepalive) || interval_ms <= 0)) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    _mutex.lock();
+    if (_keepalive_event) {
+        _iface._queue.cancel(_keepalive_event);
+        _keepalive_event = 0;
+    }
+
+    _keepalive_size = payload ? size : 0;
+    _keepalive_interval = interval_ms;
+    if (_keepalive_size) {
+        memcpy(_keepalive, payload, size);
+        _keepalive_event = _iface._queue.call_every(interval_ms, this, &WNCConnectionManager::keepalive);
+    }
+    _mutex.unlock();
+
+    return NSAPI_ERROR_OK;
+}
+
+void WNCConnectionManager::keepalive()
+{
+    // runs on the interface worker, skip a round rather than wait for a transaction
+    if (!_mutex.trylock()) {
+        return;
+    }
+
+    uint32_t now = _clock.read_ms();
+    for (int i = 0; i < MBED_CONF_APP_WNC_CM_SESSIONS; i++) {
+        session *s = &_sessions[i];
+        if (!s->handle || now - s->last_used < (uint32_t)_keepalive_interval) {
+            continue;
+        }
+
+        if (_iface.socket_closed(s->handle)
+            || _iface.socket_send(s->handle, _keepalive, _keepalive_size) != (int)_keepalive_size) {
+            drop(s);
+            continue;
+        }
+
+        _stats.keepalives++;
+        s->last_used = now;
+    }
+    _mutex.unlock();
+}
+
+void WNCConnectionManager::get_stats(WncConnStats *stats)
+{
+    _mutex.lock();
+    *stats = _stats;
+    _mutex.unlock();
+}
@@ -0,0 +1,144 @@
+/*!
+ * @file
+ * @brief Persistent TCP sessions on top of the WNC14A2A interface.
+ *
+ * Keeps connections to a host/port open across request/response
+ * cycles, reconnects lazily when the modem reports the remote side
+ * closed and can keep idle sessions alive.
+ *
+ * ```
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ```
+ */
+
+#ifndef WNC_CONNECTION_MANAGER_H
+#define WNC_CONNECTION_MANAGER_H
+
+#include "mbed.h"
+#include "WNC14A2AInterface.h"
+
+// Number of host/port sessions kept open at the same time
+#ifndef MBED_CONF_APP_WNC_CM_SESSIONS
+#  define MBED_CONF_APP_WNC_CM_SESSIONS 2
+#endif
+
+#define WNC_CM_HOST_SIZE 64
+#define WNC_CM_KEEPALIVE_SIZE 16
+
+// Quiet time in ms after which a response that started arriving is complete
+#ifndef WNC_CM_RESPONSE_GAP
+#  define WNC_CM_RESPONSE_GAP 200
+#endif
+
+/** Connection reuse counters of a WNCConnectionManager */
+struct WncConnStats
+{
+    uint32_t hits;          // requests served on an already open session
+    uint32_t misses;        // requests that had to open a session
+    uint32_t reconnects;    // sessions found closed by the remote side
+    uint32_t keepalives;    // keepalive payloads sent on idle sessions
+};
+
+/** WNCConnectionManager class
+ *  Reuses TCP sessions of a WNC14A2AInterface across request/response cycles
+ */
+class WNCConnectionManager {
+public:
+    /** WNCConnectionManager lifetime
+     * @param iface     Interface the sessions are opened on
+     */
+    WNCConnectionManager(WNC14A2AInterface &iface);
+    ~WNCConnectionManager();
+
+    /** Send a request and receive the response on a kept-open session
+     *
+     *  Opens the session on first use. If the remote side closed it in
+     *  the meantime, or the send fails, it is reconnected once. Data left
+     *  over from an earlier cycle is discarded before the request is sent.
+     *
+     *  The response is read until resp_size bytes arrived, the remote side
+     *  closed, or no more data came for WNC_CM_RESPONSE_GAP ms. A response
+     *  longer than resp_size is truncated, the rest is discarded by the
+     *  next transact() on the session.
+     *
+     *  @param host     Hostname or IP address of the server
+     *  @param port     Port of the server
+     *  @param request  Data to send
+     *  @param req_size Length of the request
+     *  @param response Buffer for the response
+     *  @param resp_size Size of the response buffer
+     *  @return         Number of response bytes received, negative error code on failure
+     */
+    nsapi_size_or_error_t transact(const char *host, uint16_t port,
+                                   const void *request, unsigned req_size,
+                                   void *response, unsigned resp_size);
+
+    /** Close the session to a host/port, if any */
+    void close(const char *host, uint16_t port);
+
+    /** Close all sessions */
+    void close_all();
+
+    /** Set how long transact() waits for a response
+     *  @param timeout_ms   Timeout in milliseconds
+     */
+    void set_timeout(int timeout_ms);
+
+    /** Send an application level keepalive on sessions idle for a while
+     *
+     *  The payload must be something the server does not answer, it is
+     *  sent on every session idle for longer than interval_ms.
+     *
+     *  @param payload      Keepalive bytes, at most WNC_CM_KEEPALIVE_SIZE, null turns keepalives off
+     *  @param size         Length of the payload
+     *  @param interval_ms  Idle time after which a keepalive is sent
+     *  @return             0 on success, negative error code on failure
+     */
+    nsapi_error_t set_keepalive(const void *payload, unsigned size, int interval_ms);
+
+    /** Get the connection reuse counters
+     *  @param stats    Destination for the counters
+     */
+    void get_stats(WncConnStats *stats);
+
+private:
+    struct session {
+        char host[WNC_CM_HOST_SIZE];
+        uint16_t port;
+        void *handle;           // interface socket handle, null when closed
+        uint32_t last_used;     // ms timestamp of the last traffic
+    };
+
+    WNC14A2AInterface &_iface;
+    session _sessions[MBED_CONF_APP_WNC_CM_SESSIONS];
+    WncConnStats _stats;
+    Mutex _mutex;
+    Semaphore _readable;
+    Timer _clock;
+    int _timeout;
+
+    char _keepalive[WNC_CM_KEEPALIVE_SIZE];
+    unsigned _keepalive_size;
+    int _keepalive_interval;
+    int _keepalive_event;
+
+    session *find(const char *host, uint16_t port);
+    session *acquire(const char *host, uint16_t port);
+    nsapi_error_t open(session *s);
+    void drop(session *s);
+    void keepalive();
+
+    static void sigio(void *data);
+};
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Link supervision for the WNC14A2A interface.
+ *
+ * ```
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ```
+ */
+
+#include <string.h>
+#include "WNCLinkSupervisor.h"
+#include "us_ticker_api.h"
+#include "mbed-trace/mbed_trace.h"
+
+#define TRACE_GROUP "wncLS"
+
+WNCLinkSupervisor::WNCLinkSupervisor(WNC14A2AInterface &iface)
+    : _iface(iface), _connected(0), _running(false), _down(false),
+      _down_since(0), _tries(0), _event(0), _was_up(false), _rng(1)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    _clock.start();
+    _iface.attach(callback(this, &WNCLinkSupervisor::status_changed));
+}
+
+WNCLinkSupervisor::~WNCLinkSupervisor()
+{
+    stop();
+    _iface.attach(NULL);
+}
+
+nsapi_error_t WNCLinkSupervisor::start()
+{
+    _mutex.lock();
+    if (_running) {
+        _mutex.unlock();
+        return NSAPI_ERROR_OK;
+    }
+    _running = true;
+    _tries = 0;
+    if (_iface.get_connection_status() != NSAPI_STATUS_GLOBAL_UP) {
+        _down = true;
+        _down_since = _clock.read_ms();
+    }
+    seed();
+    _mutex.unlock();
+
+    attempt();
+    return NSAPI_ERROR_OK;
+}
+
+void WNCLinkSupervisor::stop()
+{
+    _mutex.lock();
+    _running = false;
+    if (_event) {
+        _iface._queue.cancel(_event);
+        _event = 0;
+    }
+    _mutex.unlock();
+}
+
+nsapi_error_t WNCLinkSupervisor::wait_connected(int timeout_ms)
+{
+    Timer timer;
+    timer.start();
+    while (_iface.get_connection_status() != NSAPI_STATUS_GLOBAL_UP) {
+        int left = timeout_ms - timer.read_ms();
+        if (left <= 0 || _connected.wait(left) <= 0) {
+            return NSAPI_ERROR_TIMEOUT;
+        }
+    }
+    return NSAPI_ERROR_OK;
+}
+
+void WNCLinkSupervisor::attach(Callback<void(nsapi_event_t, intptr_t)> status_cb)
+{
+    _status_cb = status_cb;
+}
+
+void WNCLinkSupervisor::get_stats(WncLinkStats *stats)
+{
+    _mutex.lock();
+    *stats = _stats;
+    if (_down) {
+        stats->down_ms += _clock.read_ms() - _down_since;
+    }
+    _mutex.unlock();
+}
+
+void WNCLinkSupervisor::status_changed(nsapi_event_t event, intptr_t status)
+{
+    // called with the modem locked, possibly on the interface worker
+    if (event == NSAPI_EVENT_CONNECTION_STATUS_CHANGE) {
+        _mutex.lock();
+        if (status == NSAPI_STATUS_GLOBAL_UP) {
+            if (_down) {
+                uint32_t down = _clock.read_ms() - _down_since;
+                _stats.down_ms += down;
+                if (down > _stats.longest_down_ms) {
+                    _stats.longest_down_ms = down;
+                }
+                _down = false;
+            }
+            _tries = 0;
+            _was_up = true;
+            seed();
+            _connected.release();
+        } else if (status == NSAPI_STATUS_DISCONNECTED && _running) {
+            if (!_down) {
+                tr_info("link down\n");
+                _stats.outages++;
+                _down = true;
+                _down_since = _clock.read_ms();
+            }
+            schedule();
+        }
+        _mutex.unlock();
+    }
+
+    if (_status_cb) {
+        _status_cb(event, status);
+    }
+}
+
+void WNCLinkSupervisor::schedule()
+{
+    if (_event || !_running) {
+        return;
+    }
+
+    int delay = backoff(_tries);
+    tr_info("reconnect in %d ms\n", delay);
+    _event = _iface._queue.call_in(delay, this, &WNCLinkSupervisor::attempt);
+}
+
+void WNCLinkSupervisor::attempt()
+{
+    _mutex.lock();
+    _event = 0;
+    if (!_running) {
+        _mutex.unlock();
+        return;
+    }
+
+    wnc_recovery level = WNC_RECOVER_RESET;
+    if (_tries < MBED_CONF_APP_WNC_REATTACH_TRIES) {
+        level = WNC_RECOVER_REATTACH;
+    } else if (_tries < MBED_CONF_APP_WNC_REATTACH_TRIES + MBED_CONF_APP_WNC_CFUN_TRIES) {
+        level = WNC_RECOVER_CFUN;
+    }
+
+    // a modem that was never up starts from scratch whatever the level
+    if (!_was_up) {
+        _stats.startups++;
+    } else if (level == WNC_RECOVER_REATTACH) {
+        _stats.reattaches++;
+    } else if (level == WNC_RECOVER_CFUN) {
+        _stats.radio_cycles++;
+    } else {
+        _stats.resets++;
+    }
+    _tries++;
+    _stats.attempts++;
+    _mutex.unlock();
+
+    // the interface reports the outcome through status_changed(), which
+    // takes _mutex under the modem lock, so it must not be held here
+    nsapi_error_t err = _iface.reconnect(level);
+    if (err && err != NSAPI_ERROR_IN_PROGRESS) {
+        _mutex.lock();
+        schedule();
+        _mutex.unlock();
+    }
+}
+
+int WNCLinkSupervisor::backoff(int tries)
+{
+    // equal jitter: half the delay is fixed, the rest random, so a fleet
+    // that lost the network together does not come back in lockstep
+    unsigned base = MBED_CONF_APP_WNC_BACKOFF_MAX;
+    if (tries < 16 && ((unsigned)MBED_CONF_APP_WNC_BACKOFF_INITIAL << tries) < base) {
+        base = (unsigned)MBED_CONF_APP_WNC_BACKOFF_INITIAL << tries;
+    }
+    return base / 2 + next_random() % (base / 2 + 1);
+}
+
+void WNCLinkSupervisor::seed()
+{
+    // the IMEI is known once the link was up, the tick count covers the first boot
+    unsigned hash = 2166136261u;
+    for (const char *p = _iface.get_imei(); *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    // a private generator, the application's rand() sequence is left alone
+    _rng = hash ^ us_ticker_read();
+    if (!_rng) {
+        _rng = 1;
+    }
+}
+
+uint32_t WNCLinkSupervisor::next_random()
+{
+    // xorshift32
+    _rng ^= _rng << 13;
+    _rng ^= _rng >> 17;
+    _rng ^= _rng << 5;
+    return _rng;
+}
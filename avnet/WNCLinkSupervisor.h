@@ -0,0 +1,122 @@
+/*!
+ * @file
+ * @brief Keeps the WNC14A2A link up.
+ *
+ * Reconnects after a failed connect or a lost link with an exponential,
+ * jittered backoff, escalating from a re-attach over a radio cycle to a
+ * modem reset, and accounts for the time spent without a link.
+ *
+ * ```
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ```
+ */
+
+#ifndef WNC_LINK_SUPERVISOR_H
+#define WNC_LINK_SUPERVISOR_H
+
+#include "mbed.h"
+#include "WNC14A2AInterface.h"
+
+// Delay in ms before the first retry, doubled on every further failure
+#ifndef MBED_CONF_APP_WNC_BACKOFF_INITIAL
+#  define MBED_CONF_APP_WNC_BACKOFF_INITIAL 1000
+#endif
+
+// Upper bound in ms of the retry delay
+#ifndef MBED_CONF_APP_WNC_BACKOFF_MAX
+#  define MBED_CONF_APP_WNC_BACKOFF_MAX 300000
+#endif
+
+// Failed retries that only re-attach before the radio is cycled
+#ifndef MBED_CONF_APP_WNC_REATTACH_TRIES
+#  define MBED_CONF_APP_WNC_REATTACH_TRIES 2
+#endif
+
+// Failed radio cycles before the modem is reset
+#ifndef MBED_CONF_APP_WNC_CFUN_TRIES
+#  define MBED_CONF_APP_WNC_CFUN_TRIES 2
+#endif
+
+/** Link availability counters of a WNCLinkSupervisor */
+struct WncLinkStats
+{
+    uint32_t outages;           // times an established link was lost
+    uint32_t attempts;          // connects and reconnects started
+    uint32_t startups;          // connects before the link was first up, not counted below
+    uint32_t reattaches;        // reconnects that only re-attached
+    uint32_t radio_cycles;      // reconnects that cycled the radio
+    uint32_t resets;            // reconnects that reset the modem
+    uint32_t down_ms;           // total time without a link while supervised
+    uint32_t longest_down_ms;   // longest single stretch without a link
+};
+
+/** WNCLinkSupervisor class
+ *  Brings a WNC14A2AInterface up and keeps reconnecting it in the background
+ */
+class WNCLinkSupervisor {
+public:
+    /** WNCLinkSupervisor lifetime
+     * @param iface     Interface to supervise, its status callback is taken over
+     */
+    WNCLinkSupervisor(WNC14A2AInterface &iface);
+    ~WNCLinkSupervisor();
+
+    /** Connect now and reconnect whenever the link goes down
+     *  @return         0 on success, negative error code on failure
+     */
+    nsapi_error_t start();
+
+    /** Stop reconnecting, call before disconnecting the interface on purpose */
+    void stop();
+
+    /** Wait until the link is up
+     *  @param timeout_ms   Time to wait in milliseconds
+     *  @return             0 once connected, NSAPI_ERROR_TIMEOUT otherwise
+     */
+    nsapi_error_t wait_connected(int timeout_ms);
+
+    /** Register a callback for the connection status of the interface
+     *  @param status_cb    Called with every connection status change
+     */
+    void attach(Callback<void(nsapi_event_t, intptr_t)> status_cb);
+
+    /** Get the link availability counters
+     *  @param stats    Destination for the counters
+     */
+    void get_stats(WncLinkStats *stats);
+
+private:
+    WNC14A2AInterface &_iface;
+    Callback<void(nsapi_event_t, intptr_t)> _status_cb;
+    WncLinkStats _stats;
+    Mutex _mutex;
+    Semaphore _connected;
+    Timer _clock;
+
+    volatile bool _running;
+    bool _down;
+    uint32_t _down_since;       // ms timestamp the link went down
+    int _tries;                 // reconnects since the link was last up
+    int _event;
+    bool _was_up;               // the link came up at least once
+    uint32_t _rng;              // xorshift state of the backoff jitter
+
+    void status_changed(nsapi_event_t event, intptr_t status);
+    void schedule();
+    void attempt();
+    int backoff(int tries);
+    void seed();
+    uint32_t next_random();
+};
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * Transmit window scheduling for the WNC14A2A interface.
+ *
+ * ```
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ```
+ */
+
+#include <string.h>
+#include "WNCTxScheduler.h"
+
+// true if a is at or after b on the wrapping ms clock
+static bool reached(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) >= 0;
+}
+
+WNCTxScheduler::WNCTxScheduler(WNCRadioPort &port)
+    : _port(port), _active(false), _awake(true), _period(0), _hold(0), _tail(0),
+      _started(0), _awake_since(0), _awake_until(0), _tail_end(0), _next_window(0), _pending(0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void WNCTxScheduler::start(uint32_t period_ms, uint32_t hold_ms, uint32_t tail_ms)
+{
+    uint32_t now = _port.now_ms();
+
+    memset(&_stats, 0, sizeof(_stats));
+    _period = period_ms ? period_ms : 1;
+    _hold = hold_ms;
+    _tail = tail_ms;
+    _started = now;
+    _next_window = now + _period;
+    _active = true;
+
+    _port.set_awake(false);
+    _awake = false;
+    _awake_since = _awake_until = _tail_end = now;
+    arm(now);
+}
+
+void WNCTxScheduler::stop()
+{
+    if (!_active) {
+        return;
+    }
+
+    uint32_t now = _port.now_ms();
+    _port.clear_timer();
+    if (!_awake) {
+        wake(now);
+    }
+    if (_pending) {
+        _stats.sends_batched += _pending;
+        _pending = 0;
+        _port.transmit();
+    }
+    _active = false;
+}
+
+bool WNCTxScheduler::active() const
+{
+    return _active;
+}
+
+bool WNCTxScheduler::asleep() const
+{
+    return _active && !_awake;
+}
+
+void WNCTxScheduler::queued()
+{
+    if (!_active) {
+        return;
+    }
+
+    _pending++;
+    arm(_port.now_ms());
+}
+
+void WNCTxScheduler::activity()
+{
+    if (!_active) {
+        return;
+    }
+
+    uint32_t now = _port.now_ms();
+    if (!_awake) {
+        wake(now);
+    }
+    if (reached(now + _hold, _awake_until)) {
+        _awake_until = now + _hold;
+    }
+    arm(now);
+}
+
+void WNCTxScheduler::run()
+{
+    if (!_active) {
+        return;
+    }
+
+    uint32_t now = _port.now_ms();
+
+    bool window = reached(now, _next_window);
+    if (window) {
+        // the next boundary after now, windows keep their phase
+        _next_window += ((now - _next_window) / _period + 1) * _period;
+    }
+
+    // queued sends go out in a window, or right away while the modem is up anyway
+    if (_pending && (window || _awake)) {
+        if (!_awake) {
+            wake(now);
+        }
+        if (window) {
+            _stats.windows++;
+        }
+        _stats.sends_batched += _pending;
+        _pending = 0;
+        _port.transmit();
+
+        now = _port.now_ms();
+        if (reached(now + _hold, _awake_until)) {
+            _awake_until = now + _hold;
+        }
+    }
+
+    if (_awake && reached(now, _awake_until)) {
+        if (_port.idle()) {
+            sleep(now);
+        } else {
+            // data still coming in, look again after another hold
+            _awake_until = now + _hold;
+        }
+    }
+    arm(now);
+}
+
+WncRadioStats WNCTxScheduler::stats()
+{
+    uint32_t now = _port.now_ms();
+    WncRadioStats snapshot = _stats;
+
+    if (_active && _awake) {
+        snapshot.awake_ms += now - _awake_since;
+        snapshot.radio_on_ms += now - _awake_since;
+    } else if (_active && !reached(now, _tail_end)) {
+        // the tail was counted in full when the modem was let to sleep
+        snapshot.radio_on_ms -= _tail_end - now;
+    }
+
+    snapshot.elapsed_ms = _active ? now - _started : 0;
+    uint32_t on = snapshot.radio_on_ms < snapshot.elapsed_ms ? snapshot.radio_on_ms : snapshot.elapsed_ms;
+    snapshot.sleep_permille = snapshot.elapsed_ms
+                              ? (uint32_t)((uint64_t)(snapshot.elapsed_ms - on) * 1000 / snapshot.elapsed_ms)
+                              : 0;
+    return snapshot;
+}
+
+void WNCTxScheduler::wake(uint32_t now)
+{
+    _port.set_awake(true);
+    _awake = true;
+    _awake_since = now;
+    _awake_until = now;
+    _stats.wakeups++;
+
+    // woken again before the radio would have gone idle, that overlap was counted twice
+    if (!reached(now, _tail_end)) {
+        _stats.radio_on_ms -= _tail_end - now;
+    }
+}
+
+void WNCTxScheduler::sleep(uint32_t now)
+{
+    _port.set_awake(false);
+    _awake = false;
+    _stats.awake_ms += now - _awake_since;
+    _stats.radio_on_ms += now - _awake_since + _tail;
+    _tail_end = now + _tail;
+}
+
+void WNCTxScheduler::arm(uint32_t now)
+{
+    uint32_t at;
+
+    if (_awake) {
+        at = _pending ? now : _awake_until;
+    } else if (_pending) {
+        // windows passed without data are skipped, not caught up on
+        if (!reached(_next_window, now)) {
+            _next_window += ((now - _next_window) / _period + 1) * _period;
+        }
+        at = _next_window;
+    } else {
+        _port.clear_timer();
+        return;
+    }
+
+    _port.set_timer(reached(now, at) ? 0 : at - now);
+}
+
+// writes the low count bits of value as '0'/'1' characters, most significant first
+static void to_bits(uint32_t value, int count, char *bits)
+{
+    for (int i = 0; i < count; i++) {
+        bits[i] = (value >> (count - 1 - i)) & 1 ? '1' : '0';
+    }
+    bits[count] = '\0';
+}
+
+// 3 bit unit and 5 bit value, the smallest unit that holds seconds
+static void timer_bits(uint32_t seconds, const uint32_t *unit_s, const uint8_t *unit_code,
+                       int units, char *bits)
+{
+    for (int i = 0; i < units; i++) {
+        uint32_t value = (seconds + unit_s[i] - 1) / unit_s[i];
+        if (value <= 31 || i == units - 1) {
+            to_bits((uint32_t)unit_code[i] << 5 | (value <= 31 ? value : 31), 8, bits);
+            return;
+        }
+    }
+}
+
+void WNCTxScheduler::tau_bits(uint32_t seconds, char *bits)
+{
+    // TS 24.008 10.5.7.4a: 2 s, 30 s, 1 min, 10 min, 1 h, 10 h, 320 h
+    static const uint32_t unit_s[] = { 2, 30, 60, 600, 3600, 36000, 1152000 };
+    static const uint8_t unit_code[] = { 3, 4, 5, 0, 1, 2, 6 };
+    timer_bits(seconds, unit_s, unit_code, 7, bits);
+}
+
+void WNCTxScheduler::active_bits(uint32_t seconds, char *bits)
+{
+    // TS 24.008 10.5.7.3: 2 s, 1 min, 6 min
+    static const uint32_t unit_s[] = { 2, 60, 360 };
+    static const uint8_t unit_code[] = { 0, 1, 2 };
+    timer_bits(seconds, unit_s, unit_code, 3, bits);
+}
+
+void WNCTxScheduler::edrx_bits(uint32_t ms, char *bits)
+{
+    // TS 24.008 10.5.5.32, E-UTRAN eDRX cycle lengths
+    static const uint32_t cycle_ms[] = {
+        5120, 10240, 20480, 40960, 61440, 81920, 102400, 122880,
+        143360, 163840, 327680, 655360, 1310720, 2621440, 5242880, 10485760
+    };
+
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < sizeof(cycle_ms) / sizeof(cycle_ms[0]); i++) {
+        if (cycle_ms[i] <= ms) {
+            value = i;
+        }
+    }
+    to_bits(value, 4, bits);
+}
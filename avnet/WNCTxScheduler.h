@@ -0,0 +1,145 @@
+/*!
+ * @file
+ * @brief Transmit window scheduling for a sleeping WNC14A2A modem.
+ *
+ * Batches deferred socket sends into periodic transmit windows so the
+ * modem can stay in PSM/eDRX sleep in between, and estimates how long
+ * the radio was on. The modem is reached only through WNCRadioPort,
+ * nothing here depends on mbed, so the logic runs against a simulated
+ * modem on the host as well.
+ *
+ * ```
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ```
+ */
+
+#ifndef WNC_TX_SCHEDULER_H
+#define WNC_TX_SCHEDULER_H
+
+#include <stdint.h>
+
+/** What WNCTxScheduler needs from the modem and the system */
+class WNCRadioPort {
+public:
+    virtual ~WNCRadioPort() {}
+
+    /** Free running millisecond clock */
+    virtual uint32_t now_ms() = 0;
+
+    /** Drive the wakeup line, false lets the modem sleep */
+    virtual void set_awake(bool awake) = 0;
+
+    /** Write out every send held back for the window, may call WNCTxScheduler::activity() */
+    virtual void transmit() = 0;
+
+    /** Check that nothing is left to exchange with the modem, it is only let to sleep then */
+    virtual bool idle() = 0;
+
+    /** Have WNCTxScheduler::run() called once after delay_ms, replacing any earlier request */
+    virtual void set_timer(uint32_t delay_ms) = 0;
+
+    /** Drop the pending run() request, if any */
+    virtual void clear_timer() = 0;
+};
+
+/** Radio usage counters of a WNCTxScheduler */
+struct WncRadioStats
+{
+    uint32_t windows;           // transmit windows opened
+    uint32_t sends_batched;     // deferred sends written out in windows
+    uint32_t wakeups;           // times the modem was woken, windows or direct use
+    uint32_t awake_ms;          // time the wakeup line held the modem awake
+    uint32_t radio_on_ms;       // awake_ms plus the estimated connected tail after each wakeup
+    uint32_t elapsed_ms;        // time since the scheduler was started
+    uint32_t sleep_permille;    // share of elapsed_ms the radio was estimated off, in 1/1000
+};
+
+/** WNCTxScheduler class
+ *  Opens transmit windows every period and lets the modem sleep in between.
+ *  Not thread safe, the owner serializes all calls.
+ */
+class WNCTxScheduler {
+public:
+    /** WNCTxScheduler lifetime
+     * @param port      Modem and timer access
+     */
+    WNCTxScheduler(WNCRadioPort &port);
+
+    /** Start scheduling, the modem is let to sleep right away
+     * @param period_ms     Time between transmit windows
+     * @param hold_ms       Time the modem is kept awake after a window or direct use
+     * @param tail_ms       Time the radio is assumed to stay connected after being let to sleep
+     */
+    void start(uint32_t period_ms, uint32_t hold_ms, uint32_t tail_ms);
+
+    /** Stop scheduling, write out what is queued and keep the modem awake */
+    void stop();
+
+    /** Check whether sends are deferred to windows */
+    bool active() const;
+
+    /** Check whether the modem is let to sleep, background AT traffic would wake it */
+    bool asleep() const;
+
+    /** A send was held back for the next window */
+    void queued();
+
+    /** The modem is about to be used outside a window, wake it now */
+    void activity();
+
+    /** Timer callback requested through WNCRadioPort::set_timer() */
+    void run();
+
+    /** Get the radio usage counters, up to now */
+    WncRadioStats stats();
+
+    /** Encode seconds as a 3GPP T3412 extended timer (GPRS Timer 3) for AT+CPSMS
+     * @param seconds   Periodic TAU, rounded up to the next value that can be encoded
+     * @param bits      Destination for 8 '0'/'1' characters and a terminator
+     */
+    static void tau_bits(uint32_t seconds, char *bits);
+
+    /** Encode seconds as a 3GPP T3324 timer (GPRS Timer 2) for AT+CPSMS
+     * @param seconds   Active time, rounded up to the next value that can be encoded
+     * @param bits      Destination for 8 '0'/'1' characters and a terminator
+     */
+    static void active_bits(uint32_t seconds, char *bits);
+
+    /** Encode an E-UTRAN eDRX cycle for AT+CEDRXS
+     * @param ms        Wanted cycle, the longest cycle not above it is picked
+     * @param bits      Destination for 4 '0'/'1' characters and a terminator
+     */
+    static void edrx_bits(uint32_t ms, char *bits);
+
+private:
+    WNCRadioPort &_port;
+    WncRadioStats _stats;
+
+    bool _active;
+    bool _awake;
+    uint32_t _period;
+    uint32_t _hold;
+    uint32_t _tail;
+    uint32_t _started;          // ms the scheduler was started, windows align to it
+    uint32_t _awake_since;
+    uint32_t _awake_until;      // ms the modem may sleep again
+    uint32_t _tail_end;         // ms the estimated tail of the last wakeup ends
+    uint32_t _next_window;
+    uint32_t _pending;          // sends waiting for a window
+
+    void wake(uint32_t now);
+    void sleep(uint32_t now);
+    void arm(uint32_t now);
+};
+
+#endif
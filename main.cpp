@@ -18,6 +18,7 @@
 #include "common_functions.h"
 #include "UDPSocket.h"
 #include "avnet/WNC14A2AInterface.h"
+#include "avnet/WNCLinkSupervisor.h"
 #include "mbed-trace/mbed_trace.h"
 
 #define TRACE_GROUP "main"
@@ -40,8 +41,8 @@
 # define MBED_CONF_APP_PASSWORD    NULL
 #endif
 
-// Number of retries /
-#define RETRY_COUNT 3
+// Time in ms to wait for the network before giving up
+#define CONNECT_TIMEOUT 180000
 
 // Instantiate our modem
 //M66Interface modem(GSM_UART_TX, GSM_UART_RX, GSM_PWRKEY, GSM_POWER, true);
@@ -89,31 +90,21 @@ void dot_event(void const *args)
 /**
  * Connects to the Cellular Network
  */
-nsapi_error_t do_connect(WNC14A2AInterface *iface)
+nsapi_error_t do_connect(WNCLinkSupervisor *link)
 {
     nsapi_error_t retcode;
-    uint8_t retry_counter = 0;
 
     tr_debug("do_connect\n");
-    while (!iface->is_connected()) {
-
-        tr_debug("Connecting\n");
-        retcode = iface->connect();
-        if (retcode == NSAPI_ERROR_AUTH_FAILURE) {
-            tr_error("Authentication Failure. Exiting application\n");
-            return retcode;
-        } else if (retcode != NSAPI_ERROR_OK) {
-            snprintf(print_text, PRINT_TEXT_LENGTH, "Couldn't connect: %d, will retry\n", retcode);
-            tr_error(print_text);
-            retry_counter++;
-            continue;
-        } else if (retcode != NSAPI_ERROR_OK && retry_counter > RETRY_COUNT) {
-            snprintf(print_text, PRINT_TEXT_LENGTH, "Fatal connection failure: %d\n", retcode);
-            tr_error(print_text);
-            return retcode;
-        }
 
-        break;
+    /* The supervisor retries with backoff and keeps the link up afterwards */
+    retcode = link->start();
+    if (retcode == NSAPI_ERROR_OK) {
+        retcode = link->wait_connected(CONNECT_TIMEOUT);
+    }
+    if (retcode != NSAPI_ERROR_OK) {
+        snprintf(print_text, PRINT_TEXT_LENGTH, "Fatal connection failure: %d\n", retcode);
+        tr_error(print_text);
+        return retcode;
     }
 
     tr_info("Connection Established.\n");
@@ -240,12 +231,17 @@ int main()
     /* Set network credentials here, e.g., APN*/
     iface.set_credentials(MBED_CONF_APP_APN, MBED_CONF_APP_USERNAME, MBED_CONF_APP_PASSWORD);
 
+    WNCLinkSupervisor link(iface);
+
     tr_info("mbed-os-example-cellular\n");
     tr_info("Establishing connection \n");
     //dot_thread.start(callback(dot_event, (void *)&iface));
 
     /* Attempt to connect to a cellular network */
-    if (do_connect(&iface) == NSAPI_ERROR_OK) {
+    if (do_connect(&link) == NSAPI_ERROR_OK) {
+        /* Resolve the echo server while the test sets up */
+        iface.prefetch_hostname(host_name);
+
         tr_info("test_send_recv\n");
         nsapi_error_t retcode = test_send_recv(&iface);
         if (retcode != NSAPI_ERROR_OK) {
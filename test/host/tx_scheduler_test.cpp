@@ -0,0 +1,297 @@
+/*
+ * Host test of WNCTxScheduler against a simulated modem.
+ *
+ * Builds with any host compiler, no mbed OS needed:
+ *
+ *     g++ -Wall -I avnet test/host/tx_scheduler_test.cpp avnet/WNCTxScheduler.cpp -o tx_scheduler_test
+ *     ./tx_scheduler_test
+ *
+ * ```
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ```
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "WNCTxScheduler.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// The modem side of the scheduler: a clock moved by the test, the wakeup
+// line, one timer and the sends the driver holds back
+class SimModem : public WNCRadioPort {
+public:
+    SimModem() : sched(*this), now(0), awake(true), busy(false), timer_set(false),
+                 timer_at(0), held(0), sent(0), transmits(0), wakeups(0) {}
+
+    WNCTxScheduler sched;
+    uint32_t now;
+    bool awake;
+    bool busy;              // data still coming in, idle() says no
+    bool timer_set;
+    uint32_t timer_at;
+    int held;               // sends waiting in the coalescing buffers
+    int sent;
+    int transmits;
+    int wakeups;
+
+    virtual uint32_t now_ms() { return now; }
+
+    virtual void set_awake(bool on)
+    {
+        if (on && !awake) {
+            wakeups++;
+        }
+        awake = on;
+    }
+
+    virtual void transmit()
+    {
+        // writing needs the modem up, like every AT command of the driver
+        CHECK(awake);
+        sent += held;
+        held = 0;
+        transmits++;
+    }
+
+    virtual bool idle() { return !busy; }
+
+    virtual void set_timer(uint32_t delay_ms)
+    {
+        timer_set = true;
+        timer_at = now + delay_ms;
+    }
+
+    virtual void clear_timer() { timer_set = false; }
+
+    // a socket_send() on a coalescing socket
+    void send()
+    {
+        held++;
+        sched.queued();
+    }
+
+    // direct use of the AT channel, the parser's activity hook
+    void command()
+    {
+        sched.activity();
+        CHECK(awake);
+    }
+
+    // move the clock, firing the timer the way the worker queue would
+    void advance(uint32_t ms)
+    {
+        uint32_t end = now + ms;
+        while (timer_set && (int32_t)(end - timer_at) >= 0) {
+            now = timer_at;
+            timer_set = false;
+            sched.run();
+        }
+        now = end;
+    }
+};
+
+static void test_start_sleeps()
+{
+    SimModem m;
+    m.sched.start(10000, 2000, 5000);
+    CHECK(m.sched.active());
+    CHECK(m.sched.asleep());
+    CHECK(!m.awake);
+    CHECK(!m.timer_set);    // nothing queued, nothing to wake up for
+}
+
+static void test_sends_wait_for_window()
+{
+    SimModem m;
+    m.sched.start(10000, 2000, 5000);
+
+    m.advance(1000);
+    m.send();
+    m.send();
+    CHECK(!m.awake);
+    CHECK(m.timer_set && m.timer_at == 10000);
+
+    m.advance(8999);
+    CHECK(m.sent == 0);
+    CHECK(!m.awake);
+
+    m.advance(1);
+    CHECK(m.sent == 2);
+    CHECK(m.transmits == 1);
+    CHECK(m.awake);
+    CHECK(m.wakeups == 1);
+
+    // let to sleep again once the hold ran out
+    m.advance(1999);
+    CHECK(m.awake);
+    m.advance(1);
+    CHECK(!m.awake);
+    CHECK(m.sched.asleep());
+
+    // the tail is only counted as it passes
+    WncRadioStats stats = m.sched.stats();
+    CHECK(stats.windows == 1);
+    CHECK(stats.sends_batched == 2);
+    CHECK(stats.awake_ms == 2000);
+    CHECK(stats.radio_on_ms == 2000);
+    m.advance(5000);
+    CHECK(m.sched.stats().radio_on_ms == 7000);
+}
+
+static void test_windows_keep_phase()
+{
+    SimModem m;
+    m.sched.start(10000, 2000, 0);
+
+    // the first windows pass without data and are skipped
+    m.advance(25000);
+    m.send();
+    CHECK(m.timer_at == 30000);
+    m.advance(5000);
+    CHECK(m.sent == 1);
+    CHECK(m.sched.stats().windows == 1);
+}
+
+static void test_awake_modem_sends_at_once()
+{
+    SimModem m;
+    m.sched.start(10000, 2000, 0);
+
+    m.command();
+    CHECK(m.wakeups == 1);
+    m.send();
+    m.advance(0);
+    CHECK(m.sent == 1);
+    CHECK(m.sched.stats().windows == 0);
+}
+
+static void test_activity_holds_modem()
+{
+    SimModem m;
+    m.sched.start(10000, 2000, 0);
+
+    m.advance(500);
+    m.command();
+    CHECK(!m.sched.asleep());
+    m.advance(1500);
+    m.command();            // extends the hold from here
+    m.advance(1999);
+    CHECK(m.awake);
+    m.advance(1);
+    CHECK(!m.awake);
+    CHECK(m.wakeups == 1);
+}
+
+static void test_busy_modem_stays_awake()
+{
+    SimModem m;
+    m.sched.start(10000, 2000, 0);
+
+    m.command();
+    m.busy = true;
+    m.advance(2000);
+    CHECK(m.awake);         // looked again after another hold
+    m.busy = false;
+    m.advance(2000);
+    CHECK(!m.awake);
+}
+
+static void test_stop_writes_out_and_wakes()
+{
+    SimModem m;
+    m.sched.start(10000, 2000, 0);
+
+    m.send();
+    m.sched.stop();
+    CHECK(m.sent == 1);
+    CHECK(m.awake);
+    CHECK(!m.timer_set);
+    CHECK(!m.sched.active());
+    CHECK(!m.sched.asleep());
+
+    // without the scheduler nothing is held back or put to sleep
+    m.command();
+    m.advance(60000);
+    CHECK(m.awake);
+}
+
+static void test_sleep_share()
+{
+    SimModem m;
+    m.sched.start(10000, 1000, 1000);
+
+    // one send per window, the radio is on for the hold plus the tail
+    for (int i = 0; i < 10; i++) {
+        m.advance(5000);
+        m.send();
+        m.advance(5000);
+    }
+    m.advance(10000);
+    WncRadioStats stats = m.sched.stats();
+    CHECK(stats.windows == 10);
+    CHECK(stats.wakeups == 10);
+    CHECK(stats.elapsed_ms == 110000);
+    CHECK(stats.awake_ms == 10000);
+    CHECK(stats.radio_on_ms == 20000);
+    CHECK(stats.sleep_permille == 818);
+}
+
+static void test_timer_encoding()
+{
+    char bits[9];
+
+    WNCTxScheduler::tau_bits(3600, bits);       // 6 x 10 min
+    CHECK(!strcmp(bits, "00000110"));
+    WNCTxScheduler::tau_bits(60, bits);         // 30 x 2 s
+    CHECK(!strcmp(bits, "01111110"));
+    WNCTxScheduler::tau_bits(86400, bits);      // 24 h
+    CHECK(!strcmp(bits, "00111000"));
+
+    WNCTxScheduler::active_bits(30, bits);      // 15 x 2 s
+    CHECK(!strcmp(bits, "00001111"));
+    WNCTxScheduler::active_bits(120, bits);     // 2 min
+    CHECK(!strcmp(bits, "00100010"));
+
+    WNCTxScheduler::edrx_bits(20480, bits);
+    CHECK(!strcmp(bits, "0010"));
+    WNCTxScheduler::edrx_bits(100000, bits);    // 81.92 s, the longest not above
+    CHECK(!strcmp(bits, "0101"));
+}
+
+int main()
+{
+    test_start_sleeps();
+    test_sends_wait_for_window();
+    test_windows_keep_phase();
+    test_awake_modem_sends_at_once();
+    test_activity_holds_modem();
+    test_busy_modem_stays_awake();
+    test_stop_writes_out_and_wakes();
+    test_sleep_share();
+    test_timer_encoding();
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}